@@ -0,0 +1,186 @@
+/*
+    LeetCmd - fleet-scale benchmark
+
+	Runs the full per-drive sequence (INQUIRY, both mode pages, label, free
+	space) against 1..N simulated drives and prints one JSON object per
+	fleet size.
+
+	Unless -S is given, simulated latencies advance a virtual clock
+	instead of sleeping, so a run takes only the tool's own CPU time; the
+	reported wall time is that CPU time plus the simulated device time.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sim.c"
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define BENCH_MAX_DEVICES_DEFAULT 512
+
+
+int bench_drive(const char *name) {
+	device_fd = transport->open(name, 0);
+	device_name = name;
+	if(device_fd < 0)
+		return 1;
+
+	// both flags, a label and 1.2 TB free of 3 TB
+	struct request req;
+	init_request(&req);
+	req.disable_vcd = 1;
+	req.inverse = 1;
+	req.label_set = 1;
+	const char *label = "BENCH";
+	size_t i;
+	for(i = 0; label[i]; i++) {
+		int value = get_label_char(label[i]);
+		req.label[i*2] = (value >> 8) & 0xFF;
+		req.label[i*2 + 1] = value & 0xFF;
+	}
+	req.free_space = 1;
+	req.bytes_free = 1200ULL << 30;
+	req.bytes_total = 3000ULL << 30;
+	req.kb_factor = 1024;
+
+	int result = check_device(name, 0) || apply_request(name, &req);
+
+	transport->close(device_fd);
+	device_fd = -1;
+	return result;
+}
+
+
+void bench_fleet(int devices, FILE *out) {
+	uint64_t *completion = malloc(devices * sizeof(*completion));
+	if(!completion) {
+		perror("Error while malloc");
+		exit(1);
+	}
+
+	int failures = 0;
+	uint64_t start = get_time_us();
+	int i;
+	for(i = 0; i < devices; i++) {
+		char name[32];
+		snprintf(name, sizeof(name), "sim%d", i);
+		failures += bench_drive(name);
+		completion[i] = get_time_us() - start + sim_virtual_us;
+	}
+	uint64_t cpu_us = get_time_us() - start;
+
+	qsort(completion, devices, sizeof(*completion), compare_u64);
+
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+
+	fprintf(out, "{\"devices\": %d, \"wall_us\": %llu, \"cpu_wall_us\": %llu, \"commands\": %llu, "
+			"\"p50_drive_us\": %llu, \"p99_drive_us\": %llu, \"failures\": %d, \"peak_rss_kb\": %ld}\n",
+			devices,
+			(unsigned long long) (cpu_us + sim_virtual_us),
+			(unsigned long long) cpu_us,
+			(unsigned long long) sim_commands,
+			(unsigned long long) percentile(completion, devices, 50),
+			(unsigned long long) percentile(completion, devices, 99),
+			failures,
+			usage.ru_maxrss);
+	fflush(out);
+
+	free(completion);
+}
+
+
+void bench_usage(const char* exe) {
+	printf("Usage: %s [OPTIONS]\n", exe);
+	printf("\n");
+	printf("  -n <count>    largest fleet size (default %d)\n", BENCH_MAX_DEVICES_DEFAULT);
+	printf("  -l <dist>     command latency: fixed:<us> or lognormal:<median us>,<sigma>\n");
+	printf("  -s <p>,<us>   stall a command for <us> with probability <p>\n");
+	printf("  -r <seed>     random seed\n");
+	printf("  -S            really sleep for simulated latencies\n");
+}
+
+
+int main(int argc, char *argv[]) {
+	int max_devices = BENCH_MAX_DEVICES_DEFAULT;
+	uint64_t seed = 1;
+
+	int c;
+	while((c = getopt(argc, argv, "n:l:s:r:S")) != -1) {
+		switch(c) {
+		case 'n':
+			max_devices = atoi(optarg);
+			break;
+		case 'l':
+			if(sim_parse_latency(optarg)) {
+				fprintf(stderr, "Invalid latency distribution: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 's':
+			if(sim_parse_stall(optarg)) {
+				fprintf(stderr, "Invalid stall: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'r':
+			seed = strtoull(optarg, NULL, 0);
+			break;
+		case 'S':
+			sim_sleep = 1;
+			break;
+		default:
+			bench_usage(argv[0]);
+			return 1;
+		}
+	}
+	if(max_devices < 1 || optind != argc) {
+		bench_usage(argv[0]);
+		return 1;
+	}
+
+	// results go to the original stdout, the tool's own output is discarded
+	FILE *out = fdopen(dup(STDOUT_FILENO), "w");
+	if(!out || !freopen("/dev/null", "w", stdout)) {
+		perror("Error while redirecting output");
+		return 1;
+	}
+
+	transport = &sim_transport;
+
+	// each fleet size in a fresh process, for an independent peak RSS
+	int devices;
+	for(devices = 1; devices <= max_devices; devices *= 2) {
+		fflush(out);
+		pid_t pid = fork();
+		if(pid < 0) {
+			perror("Error while fork");
+			return 1;
+		}
+		if(pid == 0) {
+			sim_seed(seed + devices);
+			bench_fleet(devices, out);
+			_exit(0);
+		}
+
+		int status;
+		if(waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+			fprintf(stderr, "Benchmark for %d devices failed\n", devices);
+			return 1;
+		}
+	}
+
+	return 0;
+}
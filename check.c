@@ -0,0 +1,119 @@
+/*
+    LeetCmd - checks
+
+	Checks helpers that need no drive against hand-picked inputs, and a
+	record-then-replay run against a simulated drive. Prints one JSON object
+	and exits non-zero on any mismatch.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define STATE_DIR "/tmp/leetcmd-check"
+#include "sim.c"
+
+#define CHECK_DEVICE "/dev/sg-check"
+#define CHECK_TRACE STATE_DIR "/trace"
+#define USB_TARGET "/sys/devices/pci0000:00/0000:00:14.0/usb2/2-1/2-1:1.0/host6/target6:0:0"
+
+
+static uint64_t checks = 0;
+static uint64_t failures = 0;
+
+
+void check(int ok, const char *what) {
+	checks++;
+	if(ok)
+		return;
+	failures++;
+	fprintf(stderr, "Mismatch in %s\n", what);
+}
+
+
+void check_target_keys() {
+	// the sg node resolves to the SES LUN, a mounted partition to the disk LUN
+	uint64_t ses = get_target_key(USB_TARGET "/6:0:0:1");
+	uint64_t disk = get_target_key(USB_TARGET "/6:0:0:0");
+
+	check(ses == disk, "SES and disk LUN of one target");
+	check(ses == hash_string(USB_TARGET), "LUN cut to its target");
+	check(disk != get_target_key("/sys/devices/pci0000:00/0000:00:14.0/usb2/2-2/2-2:1.0/host7/target7:0:0/7:0:0:0"), "disk LUN of another target");
+	check(get_target_key("/sys/devices/virtual/block/loop0") == hash_string("/sys/devices/virtual/block/loop0"), "no LUN");
+	check(get_target_key(USB_TARGET "/6:0:0:0x") == hash_string(USB_TARGET "/6:0:0:0x"), "not a LUN");
+}
+
+
+// device reports go to stdout, which carries the result
+int verify_quietly(int opt_reverify, int fingerprinted, uint64_t fingerprint) {
+	fflush(stdout);
+	int saved = dup(STDOUT_FILENO);
+	int null_fd = open("/dev/null", O_WRONLY);
+	if(null_fd >= 0) {
+		dup2(null_fd, STDOUT_FILENO);
+		close(null_fd);
+	}
+
+	int result = transport == &replay_transport ? check_device(CHECK_DEVICE, 0)
+			: verify_identity(CHECK_DEVICE, 0, opt_reverify, fingerprinted, fingerprint);
+
+	fflush(stdout);
+	if(saved >= 0) {
+		dup2(saved, STDOUT_FILENO);
+		close(saved);
+	}
+	return result;
+}
+
+
+void check_replay_cached() {
+	struct device_info info;
+	uint64_t fingerprint = 0x1337;
+	char path[PATH_MAX];
+
+	transport = &sim_transport;
+	device_fd = transport->open(CHECK_DEVICE, 0);
+
+	// a first run caches the identity, a second one is answered from it
+	check(!verify_quietly(0, 1, fingerprint), "first verify");
+	check(!load_identity(CHECK_DEVICE, fingerprint, &info), "identity cached");
+	inquiry_skipped = 0;
+	check(!verify_quietly(0, 1, fingerprint) && inquiry_skipped, "cached verify");
+
+	// recording asks the drive anyway, so the replay finds its INQUIRY
+	inquiry_skipped = 0;
+	check(!open_trace(CHECK_TRACE, 1), "open trace for recording");
+	check(!verify_quietly(0, 1, fingerprint) && !inquiry_skipped, "recorded verify");
+	fclose(record_file);
+	record_file = NULL;
+
+	check(!open_trace(CHECK_TRACE, 0), "open trace for replay");
+	transport = &replay_transport;
+	check(!verify_quietly(0, 1, fingerprint), "replayed verify");
+	fclose(replay_file);
+	replay_file = NULL;
+
+	get_identity_path(CHECK_DEVICE, path);
+	unlink(path);
+	unlink(CHECK_TRACE);
+	rmdir(STATE_DIR);
+	device_fd = -1;
+}
+
+
+int main() {
+	check_target_keys();
+	check_replay_cached();
+
+	printf("{\"checks\": %llu, \"failures\": %llu}\n", (unsigned long long) checks, (unsigned long long) failures);
+	return failures != 0;
+}
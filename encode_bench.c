@@ -0,0 +1,284 @@
+/*
+    LeetCmd - free space encoder benchmark
+
+	Checks the integer free space encoder against a table of hand-checked
+	readings and against every displayable reading boundary in GB and TB,
+	for both kilobyte factors, and its hysteresis against a page as read
+	from the drive, then times it. Prints one JSON object and exits
+	non-zero on any mismatch.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define LEETCMD_NO_MAIN
+#include "leetcmd.c"
+
+#define ENCODE_BENCH_ITERATIONS_DEFAULT 10000000
+
+#define GB 1000000000ULL
+#define TB 1000000000000ULL
+
+
+struct encode_case {
+	uint64_t space_free;
+	uint64_t space_total;
+	unsigned int kb_factor;
+	uint64_t previous_free;		// UINT64_MAX: no previous display
+	const char *text;
+	int segments_used;			// -1: not displayable
+};
+
+
+static const struct encode_case encode_cases[] = {
+	{0, 1000 * GB, 1000, UINT64_MAX, "0.00 GB", 10},
+	{1000 * GB, 1000 * GB, 1000, UINT64_MAX, "1.00 TB", 0},
+	{2000 * GB, 1000 * GB, 1000, UINT64_MAX, "1.00 TB", 0},
+	{9999999999ULL, 1000 * GB, 1000, UINT64_MAX, "9.99 GB", 10},
+	{10 * GB, 1000 * GB, 1000, UINT64_MAX, " 10 GB", 10},
+	{10 * GB - 1, 1000 * GB, 1000, UINT64_MAX, "9.99 GB", 10},
+	{999999999999ULL, 1000 * GB, 1000, UINT64_MAX, "999 GB", 0},
+	{1200ULL << 30, 3000ULL << 30, 1024, UINT64_MAX, "1.17 TB", 6},
+	{1023ULL << 30, 4000ULL << 30, 1024, UINT64_MAX, "0.99 TB", 7},
+	{999ULL << 30, 4000ULL << 30, 1024, UINT64_MAX, "999 GB", 8},
+	{999999999999999ULL, 1000 * TB, 1000, UINT64_MAX, "999 TB", 0},
+	{1000 * TB, 1000 * TB, 1000, UINT64_MAX, NULL, -1},
+	{UINT64_MAX, UINT64_MAX, 1000, UINT64_MAX, NULL, -1},
+	{1, 0, 1000, UINT64_MAX, "(cleared)", 0},
+	{450, 1000, 1000, UINT64_MAX, "0.00 GB", 5},
+	{449, 1000, 1000, UINT64_MAX, "0.00 GB", 6},
+
+	// unit and format hysteresis
+	{9995 * GB / 10, 2000 * GB, 1000, 1000 * GB, "0.99 TB", 5},
+	{985 * GB, 2000 * GB, 1000, 1000 * GB, "985 GB", 5},
+	{995 * GB / 100, 2000 * GB, 1000, 10 * GB, "  9 GB", 10},
+	{985 * GB / 100, 2000 * GB, 1000, 10 * GB, "9.85 GB", 10},
+
+	// segment hysteresis
+	{559, 1000, 1000, 500, "0.00 GB", 5},
+	{560, 1000, 1000, 500, "0.00 GB", 4},
+	{441, 1000, 1000, 500, "0.00 GB", 5},
+	{440, 1000, 1000, 500, "0.00 GB", 6}
+};
+
+
+static uint64_t checks = 0;
+static uint64_t failures = 0;
+
+
+int encode(uint64_t space_free, uint64_t space_total, unsigned int kb_factor, const struct space_display *previous, struct space_display *display, char *text) {
+	int result = encode_space_display(space_free, space_total, kb_factor, previous, HYSTERESIS_DEFAULT_BP, display);
+	if(!result)
+		format_space_display(display, text);
+	return result;
+}
+
+
+void check(int ok, const char *what, uint64_t space_free, uint64_t space_total, unsigned int kb_factor, const char *text) {
+	checks++;
+	if(ok)
+		return;
+	failures++;
+	if(failures <= 20)
+		fprintf(stderr, "Mismatch in %s: %llu of %llu bytes, kb %u: %s\n", what,
+				(unsigned long long) space_free, (unsigned long long) space_total, kb_factor, text);
+}
+
+
+void check_cases() {
+	struct space_display previous;
+	struct space_display display;
+	char text[SPACE_TEXT_LEN];
+	size_t i;
+
+	for(i = 0; i < sizeof(encode_cases) / sizeof(*encode_cases); i++) {
+		const struct encode_case *c = &encode_cases[i];
+		char previous_text[SPACE_TEXT_LEN];
+
+		if(c->previous_free != UINT64_MAX)
+			encode(c->previous_free, c->space_total, c->kb_factor, NULL, &previous, previous_text);
+
+		int result = encode(c->space_free, c->space_total, c->kb_factor, c->previous_free != UINT64_MAX ? &previous : NULL, &display, text);
+		if(c->segments_used < 0)
+			check(result, "table", c->space_free, c->space_total, c->kb_factor, "displayable");
+		else
+			check(!result && !strcmp(text, c->text) && display.segments_used == c->segments_used,
+					"table", c->space_free, c->space_total, c->kb_factor, result ? "not displayable" : text);
+	}
+}
+
+
+// one-shot runs: the page read from the drive, fed back as previous display
+void check_page_previous() {
+	static const struct encode_case cases[] = {
+		{9995 * GB / 10, 2000 * GB, 1000, 1000 * GB, "0.99 TB", 5},
+		{995 * GB / 100, 2000 * GB, 1000, 10 * GB, "  9 GB", 10},
+		{559, 1000, 1000, 500, "0.00 GB", 5},
+		{9995 * GB / 10, 2000 * GB, 1000, UINT64_MAX, "999 GB", 5}
+	};
+	uint8_t page[SPACE_PAGE_LEN];
+	uint8_t data[SPACE_PAGE_LEN];
+	char text[SPACE_TEXT_LEN];
+	size_t i;
+
+	for(i = 0; i < sizeof(cases) / sizeof(*cases); i++) {
+		const struct encode_case *c = &cases[i];
+		memset(page, 0x00, sizeof(page));
+		if(c->previous_free != UINT64_MAX)
+			encode_free_space(page, c->previous_free, c->space_total, c->kb_factor, NULL, text);
+
+		memcpy(data, page, sizeof(data));
+		int result = encode_free_space(data, c->space_free, c->space_total, c->kb_factor, page, text);
+		struct space_display display;
+		decode_space_display(data, &display);
+		check(!result && !strcmp(text, c->text) && display.segments_used == c->segments_used,
+				"page", c->space_free, c->space_total, c->kb_factor, result ? "not displayable" : text);
+	}
+}
+
+
+// reading in hundredths of the shown unit
+uint64_t get_reading(const struct space_display *display) {
+	uint64_t value = 0;
+	int i;
+
+	for(i = 0; i < 3; i++)
+		value = value * 10 + ((display->digits_shown & (0x04 >> i)) ? display->digits[i] : 0);
+	return display->dec_point ? value : value * 100;
+}
+
+
+// every reading, in ascending order, must start at exactly its boundary
+void check_readings(unsigned int kb_factor) {
+	uint64_t gb = (uint64_t) kb_factor * kb_factor * kb_factor;
+	uint64_t tb = gb * kb_factor;
+	uint64_t space_total = UINT64_MAX / 100;
+	struct space_display display;
+	char text[SPACE_TEXT_LEN];
+	int tb_mode;
+
+	// previous reading, to check the byte just below each boundary
+	int last_tb_mode = 0;
+	uint64_t last_reading = 0;
+
+	for(tb_mode = 0; tb_mode < 2; tb_mode++) {
+		uint64_t unit = tb_mode ? tb : gb;
+		uint64_t first = tb_mode ? 1000 * gb : 0;
+		uint64_t reading;
+
+		for(reading = first * 100 / unit; reading < 100000; reading += reading < 1000 ? 1 : 100) {
+			unsigned __int128 boundary = ((unsigned __int128) reading * unit + 99) / 100;
+			if(boundary < first)
+				boundary = first;
+			uint64_t space_free = boundary;
+
+			int result = encode(space_free, space_total, kb_factor, NULL, &display, text);
+			check(!result && display.tb_mode == tb_mode && get_reading(&display) == reading && display.dec_point == (reading < 1000),
+					"boundary", space_free, space_total, kb_factor, result ? "not displayable" : text);
+
+			if(space_free) {
+				result = encode(space_free - 1, space_total, kb_factor, NULL, &display, text);
+				check(!result && display.tb_mode == last_tb_mode && get_reading(&display) == last_reading,
+						"below boundary", space_free - 1, space_total, kb_factor, result ? "not displayable" : text);
+			}
+
+			last_tb_mode = tb_mode;
+			last_reading = reading;
+		}
+	}
+
+	check(encode(1000 * tb, space_total, kb_factor, NULL, &display, text) == 1, "overflow", 1000 * tb, space_total, kb_factor, text);
+	check(!encode(1000 * tb - 1, space_total, kb_factor, NULL, &display, text), "overflow", 1000 * tb - 1, space_total, kb_factor, "not displayable");
+}
+
+
+// every segment count must start at exactly half a segment
+void check_segments(uint64_t space_total) {
+	struct space_display display;
+	char text[SPACE_TEXT_LEN];
+	int segments_free;
+
+	for(segments_free = 1; segments_free <= 10; segments_free++) {
+		uint64_t space_free = ((unsigned __int128) (2 * segments_free - 1) * space_total + 19) / 20;
+
+		encode(space_free, space_total, 1000, NULL, &display, text);
+		check(display.segments_used == 10 - segments_free, "segments", space_free, space_total, 1000, text);
+		encode(space_free - 1, space_total, 1000, NULL, &display, text);
+		check(display.segments_used == 11 - segments_free, "segments", space_free - 1, space_total, 1000, text);
+	}
+}
+
+
+void encode_usage(const char* exe) {
+	printf("Usage: %s [OPTIONS]\n", exe);
+	printf("\n");
+	printf("  -n <count>    encodes to time (default %d)\n", ENCODE_BENCH_ITERATIONS_DEFAULT);
+}
+
+
+int main(int argc, char *argv[]) {
+	uint64_t iterations = ENCODE_BENCH_ITERATIONS_DEFAULT;
+
+	int c;
+	while((c = getopt(argc, argv, "n:")) != -1) {
+		switch(c) {
+		case 'n':
+			iterations = strtoull(optarg, NULL, 0);
+			break;
+		default:
+			encode_usage(argv[0]);
+			return 1;
+		}
+	}
+	if(!iterations || optind != argc) {
+		encode_usage(argv[0]);
+		return 1;
+	}
+
+	check_cases();
+	check_page_previous();
+	check_readings(1000);
+	check_readings(1024);
+	uint64_t space_total;
+	for(space_total = 10; space_total < (1ULL << 48); space_total = space_total * 7 + 3)
+		check_segments(space_total);
+
+	// xorshift64 over the displayable range, previous display fed back
+	struct space_display displays[2];
+	uint64_t rng = 0x9E3779B97F4A7C15ULL;
+	uint64_t checksum = 0;
+	uint64_t i;
+
+	memset(displays, 0x00, sizeof(displays));
+	uint64_t start = get_time_us();
+	for(i = 0; i < iterations; i++) {
+		rng ^= rng << 13;
+		rng ^= rng >> 7;
+		rng ^= rng << 17;
+		uint64_t space_free = rng % (999 * TB);
+		encode_space_display(space_free, 999 * TB, 1000 + (i & 0x01) * 24, &displays[i & 0x01], HYSTERESIS_DEFAULT_BP, &displays[(i + 1) & 0x01]);
+		checksum += displays[(i + 1) & 0x01].digits[2] + displays[(i + 1) & 0x01].segments_used;
+	}
+	uint64_t elapsed_us = get_time_us() - start;
+	uint64_t ps_per_encode = elapsed_us * 1000000 / iterations;
+
+	printf("{\"checks\": %llu, \"failures\": %llu, \"encodes\": %llu, \"ns_per_encode\": %llu.%03llu, \"checksum\": %llu}\n",
+			(unsigned long long) checks,
+			(unsigned long long) failures,
+			(unsigned long long) iterations,
+			(unsigned long long) (ps_per_encode / 1000),
+			(unsigned long long) (ps_per_encode % 1000),
+			(unsigned long long) checksum);
+
+	return failures != 0;
+}
@@ -18,19 +18,112 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <ctype.h>
+#include <getopt.h>
+#include <glob.h>
+#include <dirent.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
 
 #include <scsi/sg_cmds_basic.h>
 #include <scsi/sg_cmds_extra.h>
-
+#include <scsi/sg_lib.h>
+#include <scsi/sg_pt.h>
+
+#include <sys/fanotify.h>
+#include <sys/eventfd.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/statvfs.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/timerfd.h>
+
+// USDT probes (systemtap-sdt-dev), no-ops without the header
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_SDT 1
+#endif
+#endif
+#ifndef DTRACE_PROBE1
+#define DTRACE_PROBE1(provider, name, a1) do {} while(0)
+#define DTRACE_PROBE2(provider, name, a1, a2) do {} while(0)
+#define DTRACE_PROBE3(provider, name, a1, a2, a3) do {} while(0)
+#define DTRACE_PROBE4(provider, name, a1, a2, a3, a4) do {} while(0)
+#endif
 
 #define LABEL_LEN 12
 #define LABEL_LEN_RAW (LABEL_LEN * 2)
+#define LABEL_PAGE_LEN (4 + 8 + LABEL_LEN_RAW)
+#define SPACE_PAGE_LEN (4 + 16)
+#define SPACE_TEXT_LEN 16
+#define HYSTERESIS_DEFAULT_BP 100		// hundredths of a percent
+
+#define LABEL_INTERVAL_DEFAULT_S 60
+
+#define IDLE_MAX_DEFER_DEFAULT_MS 30000
+
+#define SCSI_TIMEOUT_SECS 60
+#define NOT_READY_RETRIES 3
+#define NOT_READY_BACKOFF_MS 250
+#define SCSI_SENSE_LEN 32
+#define INQUIRY_LEN 36
+
+#define TRACE_MAGIC "LCTRACE1"
+
+#define SUPERBLOCK_READ_LEN 4096
+#define SPACE_TIMEOUT_DEFAULT_MS 2000
+#define PROBE_TIMED_OUT 2
+
+#define LOCK_DIR "/run/lock"
+#define HAND_OVER_TIMEOUT_MS 30000
+#define HAND_OVER_POLL_MS 100
+#ifndef STATE_DIR
+#define STATE_DIR "/var/lib/leetcmd"
+#endif
+
+#define WRITE_DEFERRED 2
+#define BUDGET_PERIOD_DEFAULT_S 3600
+
+#define LATENCY_ENTRIES 16
+#define LATENCY_WINDOW 16
+#define DEFAULT_READ_LATENCY_US 10000
+#define DEFAULT_WRITE_LATENCY_US 100000
+
+#define BREAKER_THRESHOLD 3
+#define BREAKER_COOLDOWN_MIN_MS 60000
+#define BREAKER_COOLDOWN_MAX_MS 3600000
+
+#define TRACE_RING_LEN 256
+#define TRACE_SNAPSHOT_LEN 40
+
+#define HISTORY_MAGIC "LCHIST01"
+#define HISTORY_LEN 8192
+
+#define FLEET_WORKERS_MAX 64
+#define CHECKPOINT_BATCH 32
+#define CHECKPOINT_SYNC_MS 1000
+
+// from linux/ioprio.h
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_WHO_PROCESS 1
 
 
 
@@ -203,16 +296,165 @@ static const uint16_t LABEL_ASCII_CHARS[] = {
 };
 
 
-static int device_fd = -1;
+/*
+ * SCSI transport
+ *
+ * Every command is issued as a CDB through the active transport: either the
+ * SG pass-through or a previously recorded trace. Optionally every command is
+ * recorded to a trace file on its way through.
+ */
+
+struct scsi_cmd {
+	uint8_t cdb[6];
+	const uint8_t *data_out;	// NULL for data-in commands
+	uint8_t *data_in;
+	size_t data_len;
+	size_t data_in_len;			// actually transferred
+	uint8_t sense[SCSI_SENSE_LEN];
+	size_t sense_len;
+	uint64_t latency_us;
+};
+
+struct transport {
+	int (*open)(const char *device, int verbose);
+	int (*close)(int fd);
+	int (*execute)(int fd, struct scsi_cmd *cmd);	// 0 or SG_LIB_CAT_* or -1
+};
+
+// trace record, followed by CDB, data-out, data-in and sense bytes
+struct trace_record {
+	uint32_t latency_us;
+	uint16_t data_out_len;
+	uint16_t data_in_len;
+	int16_t result;
+	uint8_t cdb_len;
+	uint8_t sense_len;
+};
+
+
+/*
+ * desired drive state
+ *
+ * Everything a run wants to change on a drive. Requests from concurrent
+ * instances are merged field by field, later ones taking precedence.
+ */
+
+struct request {
+	int disable_vcd;		// -1: unchanged
+	int inverse;			// -1: unchanged
+	int label_set;
+	uint8_t label[LABEL_LEN_RAW];
+	int free_space;			// update free space; bytes_total = 0 clears it
+	uint64_t bytes_free;
+	uint64_t bytes_total;
+	unsigned int kb_factor;
+	int show_state;			// print flags and label, even if unchanged
+	int disable_vcd_transient;	// to the current value only (SP=0), not saved
+	int inverse_transient;		// to the current value only (SP=0), not saved
+	int revert;				// flags back to their saved values first
+};
+
+// pages a request touches, in the order they are handled
+enum {
+	OP_REVERT = 0x01,
+	OP_DISABLE_VCD = 0x02,
+	OP_INVERSE = 0x04,
+	OP_LABEL = 0x08,
+	OP_FREE_SPACE = 0x10
+};
+
+
+/*
+ * circuit breaker
+ *
+ * A drive whose commands keep failing is left alone for a cool-down period,
+ * doubling with every failed probe, instead of being retried every cycle.
+ */
+
+struct breaker {
+	int failures;				// consecutive failed cycles
+	uint64_t open_until_ms;		// 0: closed
+	uint64_t cooldown_ms;
+};
+
+
+/*
+ * watched drive
+ *
+ * State kept across the cycles of the watch mode, so that pages are only
+ * read once and only written when their content changes.
+ */
+
+struct drive {
+	const char *device;
+	const char *path;						// NULL: no free space refresh
+	const char *label_template;				// NULL: no label refresh
+	unsigned int kb_factor;
+	int label_interval;						// minimum seconds between label writes
+	uint8_t label_page[LABEL_PAGE_LEN];		// as on the drive
+	uint64_t label_written_ms;
+	uint8_t space_page[SPACE_PAGE_LEN];		// as read from the drive
+	uint8_t space_written[SPACE_PAGE_LEN];	// as last written
+	int space_written_valid;
+	uint64_t space_next_ms;					// next free space sample
+	uint64_t space_sample_ms;				// last free space sample
+	uint64_t space_sample_free;
+	uint64_t space_sample_total;
+	struct space_probe *space_probe;		// stuck probe of <path>
+	struct space_probe *used_probe;			// stuck probe of <path> for {used}
+	double fill_rate;						// bytes per second, negative while filling
+	int fill_rate_valid;
+	int fanotify_fd;						// -1: sample free space periodically
+	const char *path_arg;					// <path> as given
+	uint64_t key;							// 0: <path> not following the drive's mounts
+	char bound_path[PATH_MAX];				// mount of the drive <path> was rebound to
+	int unmounted;							// no file system of the drive mounted
+	FILE *mountinfo;						// NULL: mount table not watched
+	int mounts_changed;
+	struct breaker breaker;
+};
+
+
+// per thread: in fleet mode, every worker talks to one drive at a time
+static __thread int device_fd = -1;
+static __thread const char *device_name = "";	// for probes
+static __thread int inquiry_skipped = 0;		// model check answered from the identity cache
 static int opt_verbose = 0;
+static int opt_idle_window = 0;
+static int opt_idle_max_defer = IDLE_MAX_DEFER_DEFAULT_MS;
+static int opt_predict_min = 0;		// 0: sample free space every watch interval
+static int opt_predict_max = 0;
+static int opt_fanotify_debounce = 0;	// 0: no write-triggered sampling
+static unsigned int opt_hysteresis_bp = HYSTERESIS_DEFAULT_BP;	// band around unit, format and segment switches
+
+static __thread int lock_fd = -1;
+static __thread char spool_dir[PATH_MAX];
+
+static const struct transport *transport;
+static FILE *record_file = NULL;
+static FILE *replay_file = NULL;
+static int opt_replay_realtime = 0;
 
 void clean_up() {
 	if(device_fd >= 0) {
-		int result = sg_cmds_close_device(device_fd);
+		int result = transport->close(device_fd);
 		if(result != 0)
-			perror("Error while sg_cmds_close_device");
+			perror("Error while closing device");
 		device_fd = -1;
 	}
+	if(record_file) {
+		if(fclose(record_file))
+			perror("Error while writing trace");
+		record_file = NULL;
+	}
+	if(replay_file) {
+		fclose(replay_file);
+		replay_file = NULL;
+	}
+	if(lock_fd >= 0) {
+		close(lock_fd);
+		lock_fd = -1;
+	}
 }
 
 
@@ -290,315 +532,4975 @@ void dump_data(const uint8_t *data, size_t len) {
 }
 
 
-int check_device(const char *opt_device, int opt_force) {
-	struct sg_simple_inquiry_resp data;
-
-	if(opt_verbose)
-		printf("Reading device information...\n");
-	int check_result = sg_simple_inquiry(device_fd, &data, 0, opt_verbose);
-	if(check_result != 0) {
-		fprintf(stderr, "Error while sg_simple_inquiry: %d\n", check_result);
-		return 1;
-	}
+uint64_t get_time_us() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-	// check against model list
-	int valid = 0;
-	const char** model = SUPPORTED_MODELS;
-	while(*model) {
-		if(!strcmp(data.vendor, model[0]) && !strcmp(data.product, model[1])) {
-			valid = 1;
-			break;
-		}
-		model += 2;
-	}
 
-	const char* check_result_text = valid ? "supported" : (opt_force ? "unsupported; continuing forced" : "unsupported; aborting");
-	check_result = (valid || opt_force) ? 0 : 1;
-	FILE *target = check_result ? stderr : stdout;
+static uint64_t clock_skew_ms = 0;		// simulations run the schedules ahead of real time
 
-	fprintf(target, "Device: %s (%s)\n", opt_device, check_result_text);
-	fprintf(target, "%s - %s (rev %s)\n", data.vendor, data.product, data.revision);
 
-	return check_result;
+uint64_t get_time_ms() {
+	return get_time_us() / 1000 + clock_skew_ms;
 }
 
 
-int handle_mode_page_flag_value(int opt_flag, const char *name, uint8_t page, size_t result_len, size_t flag_offset, size_t flag_bit) {
-	int result;
-	uint8_t data[6 + result_len];
-	uint8_t* page_data = data + 6;
+void sleep_us(uint64_t us) {
+	struct timespec ts;
+	ts.tv_sec = us / 1000000;
+	ts.tv_nsec = (us % 1000000) * 1000;
+	nanosleep(&ts, NULL);
+}
 
-	// load setting
-	if(opt_verbose)
-		printf("Reading %s value...\n", name);
-	result = sg_ll_mode_sense6(device_fd, 1, 0, page, 0x00, data, sizeof(data), 0, opt_verbose);
-	if(result != 0) {
-		fprintf(stderr, "Error while sg_ll_mode_sense6: %d\n", result);
-		return 1;
-	}
-	if(opt_verbose)
-		dump_data(data, sizeof(data));
 
+void sleep_ms(uint64_t ms) {
+	sleep_us(ms * 1000);
+}
 
-	if(check_mode_page(data, page, result_len)) {
-		fprintf(stderr, "Error getting %s value - aborting!\n", name);
-		return 1;
-	}
 
-	int flag_value = get_bit(page_data, flag_offset, flag_bit);
+int sg_open(const char *device, int verbose) {
+	return sg_cmds_open_device(device, 1, verbose);
+}
 
-	if(opt_flag != -1 && flag_value != opt_flag) {
-		// reset PS flag (as reserved when using MODE SELECT)
-		data[4] &= 0x7F;
 
-		set_bit(page_data, flag_offset, flag_bit, opt_flag);
-		printf("%s state: %d -> %d\n", name, flag_value, opt_flag);
+int sg_execute(int fd, struct scsi_cmd *cmd) {
+	struct sg_pt_base *pt = construct_scsi_pt_obj();
+	if(!pt)
+		return -1;
 
-		// save setting
-		if(opt_verbose) {
-			printf("Writing %s value...\n", name);
-			dump_data(data, sizeof(data));
-		}
-		result = sg_ll_mode_select6(device_fd, 1, 1, data, sizeof(data), 0, opt_verbose);
-		if(result != 0) {
-			fprintf(stderr, "Error while sg_ll_mode_select6: %d\n", result);
-			return 1;
-		}
+	set_scsi_pt_cdb(pt, cmd->cdb, sizeof(cmd->cdb));
+	set_scsi_pt_sense(pt, cmd->sense, sizeof(cmd->sense));
+	if(cmd->data_out)
+		set_scsi_pt_data_out(pt, cmd->data_out, cmd->data_len);
+	else if(cmd->data_len)
+		set_scsi_pt_data_in(pt, cmd->data_in, cmd->data_len);
+
+	int result = do_scsi_pt(pt, fd, SCSI_TIMEOUT_SECS, opt_verbose);
+	if(result == SCSI_PT_DO_TIMEOUT) {
+		result = SG_LIB_CAT_TIMEOUT;
+	} else if(result) {
+		result = -1;
 	} else {
-		printf("%s state: %d%s\n", name, flag_value, flag_value == opt_flag ? " (already)" : "");
+		switch(get_scsi_pt_result_category(pt)) {
+		case SCSI_PT_RESULT_GOOD:
+			result = 0;
+			break;
+		case SCSI_PT_RESULT_SENSE:
+			cmd->sense_len = get_scsi_pt_sense_len(pt);
+			result = sg_err_category_sense(cmd->sense, cmd->sense_len);
+			if(result == SG_LIB_CAT_RECOVERED || result == SG_LIB_CAT_NO_SENSE)
+				result = 0;
+			break;
+		default:
+			result = -1;
+			break;
+		}
 	}
+	if(!cmd->data_out && result == 0)
+		cmd->data_in_len = cmd->data_len - get_scsi_pt_resid(pt);
 
-	return 0;
+	destruct_scsi_pt_obj(pt);
+	return result;
 }
 
 
-void print_label(const uint8_t *data) {
-	int i;
-	int j;
-	uint8_t lines[5][72];
+static const struct transport sg_transport = {
+	sg_open,
+	sg_cmds_close_device,
+	sg_execute
+};
 
-	// init output
-	memset(lines, 0x20, 5 * 72);
 
-	// prepare output
-	int term_offset = 0;
-	for(i = 0; i < 12; i++) {
-		uint16_t char_value = (data[i * 2] << 8) | data[i * 2 + 1];
+int replay_open(const char *device, int verbose) {
+	(void) device;
+	(void) verbose;
+	return 0;
+}
 
-		// if no segment displayed, skip digit
-		if(char_value == 0x0000)
-			continue;
 
-		// map segments
-		int col_offset = i * 6;
-		for(j = 0; j < 14; j++) {
-			if(char_value & (1 << j)) {
-				const struct SEGMENT_MAPPING* m = &segment_mappings[j];
-				memcpy(&lines[m->row_offset][col_offset + m->col_offset], m->text, strlen(m->text));
-			}
-		}
-		term_offset = col_offset + 5;
+int replay_close(int fd) {
+	(void) fd;
+	return 0;
+}
+
+
+int replay_execute(int fd, struct scsi_cmd *cmd) {
+	(void) fd;
+	struct trace_record rec;
+	uint8_t cdb[sizeof(cmd->cdb)];
+	uint8_t data_out[UINT16_MAX];
+
+	if(fread(&rec, sizeof(rec), 1, replay_file) != 1) {
+		fprintf(stderr, "Replay: trace exhausted\n");
+		return -1;
+	}
+	if(rec.cdb_len != sizeof(cdb) || rec.sense_len > sizeof(cmd->sense)
+			|| (!cmd->data_out && rec.data_in_len > cmd->data_len)
+			|| fread(cdb, sizeof(cdb), 1, replay_file) != 1
+			|| fread(data_out, 1, rec.data_out_len, replay_file) != rec.data_out_len
+			|| fread(cmd->data_in, 1, rec.data_in_len, replay_file) != rec.data_in_len
+			|| fread(cmd->sense, 1, rec.sense_len, replay_file) != rec.sense_len) {
+		fprintf(stderr, "Replay: malformed trace record\n");
+		return -1;
 	}
 
-	// set terminator + print output
-	for(i = 0; i < 5; i++) {
-		lines[i][term_offset] = 0x00;
-		printf("%s\n", lines[i]);
+	// the tool must issue exactly what was recorded
+	if(memcmp(cdb, cmd->cdb, sizeof(cdb))
+			|| (cmd->data_out && (rec.data_out_len != cmd->data_len || memcmp(data_out, cmd->data_out, cmd->data_len)))) {
+		fprintf(stderr, "Replay: command diverges from trace\n");
+		return -1;
 	}
+
+	if(opt_replay_realtime)
+		sleep_us(rec.latency_us);
+
+	cmd->data_in_len = rec.data_in_len;
+	cmd->sense_len = rec.sense_len;
+	return rec.result;
 }
 
 
-int get_label_char(char c) {
-	if(c < LABEL_ASCII_CHARS_START || c > LABEL_ASCII_CHARS_END)
-		return -1;
+static const struct transport replay_transport = {
+	replay_open,
+	replay_close,
+	replay_execute
+};
 
-	return LABEL_ASCII_CHARS[c - LABEL_ASCII_CHARS_START];
-}
 
+void trace_write(const struct scsi_cmd *cmd, int result) {
+	struct trace_record rec;
+	rec.latency_us = cmd->latency_us > UINT32_MAX ? UINT32_MAX : cmd->latency_us;
+	rec.data_out_len = cmd->data_out ? cmd->data_len : 0;
+	rec.data_in_len = cmd->data_out ? 0 : cmd->data_in_len;
+	rec.result = result;
+	rec.cdb_len = sizeof(cmd->cdb);
+	rec.sense_len = cmd->sense_len;
+
+	fwrite(&rec, sizeof(rec), 1, record_file);
+	fwrite(cmd->cdb, sizeof(cmd->cdb), 1, record_file);
+	fwrite(cmd->data_out, 1, rec.data_out_len, record_file);
+	fwrite(cmd->data_in, 1, rec.data_in_len, record_file);
+	fwrite(cmd->sense, 1, rec.sense_len, record_file);
+}
 
-int handle_label_value(const uint8_t* label) {
-	int result;
-	uint8_t data[4 + 8 + LABEL_LEN_RAW];
-	uint8_t* page_data = data + 4;
-	uint8_t* label_data = page_data + 8;
 
-	// load setting
-	if(opt_verbose)
-		printf("Reading label value...\n");
-	result = sg_ll_receive_diag(device_fd, 1, 0x87, data, sizeof(data), 0, opt_verbose);
-	if(result != 0) {
-		fprintf(stderr, "Error while sg_ll_receive_diag: %d\n", result);
+int open_trace(const char *path, int write) {
+	char magic[sizeof(TRACE_MAGIC) - 1];
+	FILE *f = fopen(path, write ? "wb" : "rb");
+	if(!f) {
+		perror("Error while opening trace");
 		return 1;
 	}
-	if(opt_verbose)
-		dump_data(data, sizeof(data));
 
-
-	if(check_diag_page(data, 0x87, 8 + LABEL_LEN_RAW)) {
-		fprintf(stderr, "Error getting label value - aborting!\n");
-		return 1;
+	if(write) {
+		fwrite(TRACE_MAGIC, sizeof(magic), 1, f);
+		record_file = f;
+	} else {
+		if(fread(magic, sizeof(magic), 1, f) != 1 || memcmp(magic, TRACE_MAGIC, sizeof(magic))) {
+			fprintf(stderr, "Not a trace file: %s\n", path);
+			fclose(f);
+			return 1;
+		}
+		replay_file = f;
 	}
 
-	printf("Label:\n");
-	print_label(label_data);
+	return 0;
+}
 
-	// return, if no new label
-	if(!label)
-		return 0;
 
-	// return, if no change
-	if(!memcmp(label_data, label, LABEL_LEN_RAW))
-		return 0;
+/*
+ * latency history
+ *
+ * Mean latencies per command and page, kept per drive and per USB bridge
+ * model, feed the cost model of the planner.
+ */
 
-	memcpy(label_data, label, LABEL_LEN_RAW);
+struct latency_entry {
+	uint8_t opcode;
+	uint8_t page;
+	uint64_t count;
+	double mean_us;
+};
 
-	printf("New label:\n");
-	print_label(label_data);
+struct latency_history {
+	char path[PATH_MAX];		// empty: not persisted
+	struct latency_entry entries[LATENCY_ENTRIES];
+	size_t count;
+};
 
-	// save setting
-	if(opt_verbose) {
-		printf("Writing label value...\n");
-		dump_data(data, sizeof(data));
+static __thread struct latency_history drive_latency;
+static __thread struct latency_history bridge_latency;
+
+
+const char* get_command_name(uint8_t opcode) {
+	switch(opcode) {
+	case 0x12:
+		return "INQUIRY";
+	case 0x15:
+		return "MODE SELECT";
+	case 0x1A:
+		return "MODE SENSE";
+	case 0x1C:
+		return "RECEIVE DIAG";
+	case 0x1D:
+		return "SEND DIAG";
+	default:
+		return "UNKNOWN";
 	}
-	result = sg_ll_send_diag(device_fd, 0, 1, 0, 0, 0, 0, data, sizeof(data), 0, opt_verbose);
-	if(result != 0) {
-		fprintf(stderr, "Error while sg_ll_send_diag: %d\n", result);
-		return 1;
+}
+
+
+uint8_t get_command_page(const struct scsi_cmd *cmd) {
+	switch(cmd->cdb[0]) {
+	case 0x15:
+		return cmd->data_len > 4 ? cmd->data_out[4] & 0x3F : 0;
+	case 0x1A:
+		return cmd->cdb[2] & 0x3F;
+	case 0x1C:
+		return cmd->cdb[2];
+	case 0x1D:
+		return cmd->data_len > 0 ? cmd->data_out[0] : 0;
+	default:
+		return 0;
 	}
+}
 
-	return 0;
+
+struct latency_entry* find_latency(struct latency_history *history, uint8_t opcode, uint8_t page, int create) {
+	size_t i;
+	for(i = 0; i < history->count; i++)
+		if(history->entries[i].opcode == opcode && history->entries[i].page == page)
+			return &history->entries[i];
+
+	if(!create || history->count == LATENCY_ENTRIES)
+		return NULL;
+
+	struct latency_entry *entry = &history->entries[history->count++];
+	memset(entry, 0x00, sizeof(*entry));
+	entry->opcode = opcode;
+	entry->page = page;
+	return entry;
 }
 
 
-int set_free_space(uint64_t space_free, uint64_t space_total, double kb_factor) {
-	int result;
-	uint8_t data[4 + 16];
-	uint8_t *page_data = data + 4;
+void add_latency(struct latency_history *history, uint8_t opcode, uint8_t page, uint64_t latency_us) {
+	struct latency_entry *entry = find_latency(history, opcode, page, 1);
+	if(!entry)
+		return;
 
-	// load page content
-	if(opt_verbose)
-		printf("Reading page content...\n");
-	result = sg_ll_receive_diag(device_fd, 1, 0x86, data, sizeof(data), 0, opt_verbose);
-	if(result != 0) {
-		fprintf(stderr, "Error while sg_ll_receive_diag: %d\n", result);
-		return 1;
+	// running mean over the first samples, moving average afterwards
+	if(entry->count < LATENCY_WINDOW)
+		entry->count++;
+	entry->mean_us += ((double) latency_us - entry->mean_us) / entry->count;
+}
+
+
+void load_latency_history(struct latency_history *history, const char *path) {
+	memset(history, 0x00, sizeof(*history));
+	snprintf(history->path, sizeof(history->path), "%s", path);
+
+	FILE *f = fopen(path, "r");
+	if(!f)
+		return;
+
+	unsigned int opcode;
+	unsigned int page;
+	unsigned long long count;
+	double mean_us;
+	while(fscanf(f, "%x %x %llu %lf", &opcode, &page, &count, &mean_us) == 4) {
+		struct latency_entry *entry = find_latency(history, opcode, page, 1);
+		if(entry) {
+			entry->count = count;
+			entry->mean_us = mean_us;
+		}
 	}
-	if(opt_verbose)
-		dump_data(data, sizeof(data));
+	fclose(f);
+}
 
-	// reset all bits with known meaning
-	page_data[4] &= ~(0x80);
-	page_data[6] = 0x00;
-	page_data[7] &= ~(0xC0);
-	page_data[10] &= ~(0x16);
-	page_data[11] &= ~(0x02);
-	page_data[12] &= ~(0x8F);
-	page_data[13] &= ~(0x8F);
-	page_data[14] &= ~(0x8F);
 
-	if(space_total) {
-		// calculate segment value
-		double segments_free_precise = ((double) space_free) / ((double) space_total) * 10.0;
-		int segments_used = 10 - (int) (segments_free_precise + 0.5);
-		int i;
+void save_latency_history(const struct latency_history *history) {
+	if(!history->path[0] || !history->count)
+		return;
 
-		uint16_t segments_raw = 0x0000;
-		for(i = 0; i < segments_used; i++)
-			segments_raw |= 1 << (9 - i);
+	// per thread, as workers may save the history of the same bridge
+	char tmp_path[PATH_MAX + 16];
+	snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", history->path, (int) syscall(SYS_gettid));
+	FILE *f = fopen(tmp_path, "w");
+	if(!f)
+		return;
 
-		// segment frame
-		set_bit(page_data, 4, 7, 1);
+	size_t i;
+	for(i = 0; i < history->count; i++) {
+		const struct latency_entry *entry = &history->entries[i];
+		fprintf(f, "%02x %02x %llu %.0f\n", entry->opcode, entry->page, (unsigned long long) entry->count, entry->mean_us);
+	}
+	if(fclose(f) || rename(tmp_path, history->path))
+		perror("Error while saving latency history");
+}
 
-		// segments
-		page_data[6] = segments_raw >> 2;
-		page_data[7] |= (segments_raw & 0x03) << 6;
 
+void save_latency_histories() {
+	save_latency_history(&drive_latency);
+	save_latency_history(&bridge_latency);
+}
 
-		// calculate display value
-		double displayed_space = space_free / kb_factor / kb_factor / kb_factor;	// GB
-		int tb_mode = displayed_space >= 1000.0 ? 1 : 0;
-		if(tb_mode)
-			displayed_space /= kb_factor;	// TB
 
-		// abort on non-displayable value
-		if(displayed_space >= 1000.0) {
-			fprintf(stderr, "Free space too large for display: %f.2 TB\n", displayed_space);
-			return 1;
-		}
+// estimated latency; source is set to where it came from
+double estimate_latency(uint8_t opcode, uint8_t page, const char **source) {
+	const struct latency_entry *entry = find_latency(&drive_latency, opcode, page, 0);
+	*source = "drive";
+	if(!entry) {
+		entry = find_latency(&bridge_latency, opcode, page, 0);
+		*source = "bridge";
+	}
+	if(entry)
+		return entry->mean_us;
 
-		// digits + decimal point
-		char displayed_digits[5];
-		uint8_t digit_100s = 0;
-		uint8_t digit_10s = 0;
-		uint8_t digit_1s = 0;
-		int dec_point = 0;
+	*source = "default";
+	return opcode == 0x15 || opcode == 0x1D ? DEFAULT_WRITE_LATENCY_US : DEFAULT_READ_LATENCY_US;
+}
 
-		if(displayed_space >= 10.0) {	// range ' 10' to '999'
-			int displayed_space_int = (int) displayed_space;
-			snprintf(displayed_digits, sizeof(displayed_digits), "%3d", displayed_space_int);
 
-			if(displayed_space_int >= 100)
-				digit_100s = 0x80 | (displayed_digits[0] - 0x30);
-			digit_10s  = 0x80 | (displayed_digits[1] - 0x30);
-			digit_1s   = 0x80 | (displayed_digits[2] - 0x30);
-		} else {						// range '0.00' to '9.99'
-			snprintf(displayed_digits, sizeof(displayed_digits), "%4f.2", displayed_space);
+/*
+ * command trace ring
+ *
+ * Every command leaves a fixed-size binary record in a ring of the issuing
+ * thread. Only the owning thread writes its ring, so recording is a plain
+ * copy without locks or stdio, cheap enough to be always on. Records are
+ * decoded on demand only: with -v or --dump-trace at exit, and on SIGUSR1,
+ * by the watch loop or the first fleet worker between drives, otherwise at
+ * exit. The command path itself never prints a trace.
+ */
 
-			digit_100s = 0x80 | (displayed_digits[0] - 0x30);
-			dec_point = 1;
-			digit_10s  = 0x80 | (displayed_digits[2] - 0x30);
-			digit_1s   = 0x80 | (displayed_digits[3] - 0x30);
-		}
+struct trace_entry {
+	uint64_t seq;			// 0: unused, odd: being written
+	uint64_t time_us;
+	uint32_t latency_us;
+	int16_t result;
+	uint8_t cdb[6];
+	uint8_t page;
+	uint8_t sense_key;
+	uint8_t asc;
+	uint8_t ascq;
+	uint8_t data_len;		// snapshot of the payload, possibly truncated
+	uint8_t data[TRACE_SNAPSHOT_LEN];
+};
 
-		page_data[12] |= digit_100s;
-		page_data[13] |= digit_10s;
-		page_data[14] |= digit_1s;
-		if(dec_point)
-			set_bit(page_data, 11, 1, 1);
+struct trace_ring {
+	struct trace_ring *next;
+	pid_t tid;
+	uint64_t head;			// records written so far
+	struct trace_entry entries[TRACE_RING_LEN];
+};
 
-		// TB/GB indicator
-		set_bit(page_data, 10, tb_mode ? 2 : 1, 1);
+static struct trace_ring *trace_rings = NULL;
+static __thread struct trace_ring *trace_ring = NULL;
+static uint64_t trace_epoch_us = 0;
+static int opt_dump_trace = 0;
+static volatile sig_atomic_t trace_dump_requested = 0;
 
-		// FREE indicator
-		set_bit(page_data, 10, 4, 1);
 
-		printf("Free space: %s %s\n", displayed_digits, tb_mode ? "TB" : "GB");
-	} else {
-		printf("Free space: (cleared)\n");
-	}
+void request_trace_dump(int sig) {
+	(void) sig;
+	trace_dump_requested = 1;
+}
 
-	// save setting
-	if(opt_verbose) {
-		printf("Writing free space value...\n");
-		dump_data(data, sizeof(data));
-	}
-	result = sg_ll_send_diag(device_fd, 0, 1, 0, 0, 0, 0, data, sizeof(data), 0, opt_verbose);
-	if(result != 0) {
-		fprintf(stderr, "Error while sg_ll_send_diag: %d\n", result);
-		return 1;
+
+// sense key, ASC and ASCQ of fixed or descriptor format sense data
+void get_sense(const struct scsi_cmd *cmd, uint8_t *sense_key, uint8_t *asc, uint8_t *ascq) {
+	*sense_key = 0;
+	*asc = 0;
+	*ascq = 0;
+
+	uint8_t response_code = cmd->sense_len ? cmd->sense[0] & 0x7F : 0;
+	if((response_code == 0x70 || response_code == 0x71) && cmd->sense_len >= 14) {
+		*sense_key = cmd->sense[2] & 0x0F;
+		*asc = cmd->sense[12];
+		*ascq = cmd->sense[13];
+	} else if((response_code == 0x72 || response_code == 0x73) && cmd->sense_len >= 4) {
+		*sense_key = cmd->sense[1] & 0x0F;
+		*asc = cmd->sense[2];
+		*ascq = cmd->sense[3];
 	}
+}
 
-	return 0;
+
+struct trace_ring* get_trace_ring() {
+	if(trace_ring)
+		return trace_ring;
+
+	struct trace_ring *ring = calloc(1, sizeof(*ring));
+	if(!ring)
+		return NULL;
+	ring->tid = syscall(SYS_gettid);
+
+	// rings are never freed, so a plain push is enough
+	ring->next = __atomic_load_n(&trace_rings, __ATOMIC_RELAXED);
+	while(!__atomic_compare_exchange_n(&trace_rings, &ring->next, ring, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+	trace_ring = ring;
+	return ring;
 }
 
 
-void usage(const char* exe) {
-	printf("Controls the electronic ink display of WD My Book HDDs.\n");
+void trace_command(const struct scsi_cmd *cmd, int result, uint64_t start_us) {
+	struct trace_ring *ring = get_trace_ring();
+	if(!ring)
+		return;
+
+	uint64_t seq = ring->head + 1;
+	struct trace_entry *entry = &ring->entries[ring->head % TRACE_RING_LEN];
+
+	// odd while being written, so a concurrent reader skips the record
+	__atomic_store_n(&entry->seq, seq * 2 - 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	entry->time_us = start_us;
+	entry->latency_us = cmd->latency_us;
+	entry->result = result;
+	memcpy(entry->cdb, cmd->cdb, sizeof(entry->cdb));
+	entry->page = get_command_page(cmd);
+	get_sense(cmd, &entry->sense_key, &entry->asc, &entry->ascq);
+
+	const uint8_t *data = cmd->data_out ? cmd->data_out : cmd->data_in;
+	size_t len = cmd->data_out ? cmd->data_len : cmd->data_in_len;
+	entry->data_len = len < TRACE_SNAPSHOT_LEN ? len : TRACE_SNAPSHOT_LEN;
+	memcpy(entry->data, data, entry->data_len);
+
+	__atomic_store_n(&entry->seq, seq * 2, __ATOMIC_RELEASE);
+	__atomic_store_n(&ring->head, seq, __ATOMIC_RELEASE);
+}
+
+
+void print_trace_entry(const struct trace_entry *entry) {
+	printf("[%4llu.%06llu] %s", (unsigned long long) ((entry->time_us - trace_epoch_us) / 1000000),
+			(unsigned long long) ((entry->time_us - trace_epoch_us) % 1000000), get_command_name(entry->cdb[0]));
+	if(entry->cdb[0] != 0x12)
+		printf(" 0x%02X", entry->page);
+	printf(": %d (%.1f ms)", entry->result, entry->latency_us / 1000.0);
+	if(entry->sense_key || entry->asc || entry->ascq)
+		printf(", sense %X/%02X/%02X", entry->sense_key, entry->asc, entry->ascq);
+	printf("\n    cdb:");
+	dump_data(entry->cdb, sizeof(entry->cdb));
+	if(entry->data_len) {
+		printf("    data:");
+		dump_data(entry->data, entry->data_len);
+	}
+}
+
+
+void dump_trace() {
+	struct trace_ring *ring;
+	for(ring = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+		uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		uint64_t first = head > TRACE_RING_LEN ? head - TRACE_RING_LEN : 0;
+
+		printf("Trace of thread %d (%llu commands):\n", (int) ring->tid, (unsigned long long) head);
+		uint64_t seq;
+		for(seq = first + 1; seq <= head; seq++) {
+			const struct trace_entry *slot = &ring->entries[(seq - 1) % TRACE_RING_LEN];
+			struct trace_entry entry;
+
+			// copy, then check the record was not overwritten meanwhile
+			if(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != seq * 2)
+				continue;
+			memcpy(&entry, slot, sizeof(entry));
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if(__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq * 2)
+				continue;
+
+			print_trace_entry(&entry);
+		}
+	}
+	fflush(stdout);
+}
+
+
+void dump_trace_at_exit() {
+	if(opt_dump_trace || trace_dump_requested)
+		dump_trace();
+}
+
+
+/*
+ * sense classification
+ *
+ * A pending UNIT ATTENTION (reset, power on, ...) only reports an event, so
+ * the command is retried once right away. A drive that is NOT READY may
+ * become ready, so the command is retried with growing delays, unless it
+ * waits for an intervention. ILLEGAL REQUEST (e.g. unsupported page) will
+ * not go away by retrying, nor will anything else.
+ */
+
+enum sense_action {
+	SENSE_FAIL,
+	SENSE_RETRY,
+	SENSE_BACKOFF
+};
+
+static __thread uint8_t last_sense[3];		// key, ASC, ASCQ of the last failure
+static __thread uint64_t command_failures = 0;
+static __thread uint64_t commands_issued = 0;	// a cycle without commands says nothing about the drive
+
+
+enum sense_action classify_sense(uint8_t sense_key, uint8_t asc, uint8_t ascq) {
+	switch(sense_key) {
+	case 0x06:	// UNIT ATTENTION
+		return SENSE_RETRY;
+	case 0x02:	// NOT READY
+		// medium not present, manual intervention required
+		if(asc == 0x3A || (asc == 0x04 && ascq == 0x03))
+			return SENSE_FAIL;
+		return SENSE_BACKOFF;
+	default:
+		return SENSE_FAIL;
+	}
+}
+
+
+const char* get_sense_key_name(uint8_t sense_key) {
+	static const char *names[] = {
+		"NO SENSE", "RECOVERED ERROR", "NOT READY", "MEDIUM ERROR",
+		"HARDWARE ERROR", "ILLEGAL REQUEST", "UNIT ATTENTION", "DATA PROTECT",
+		"BLANK CHECK", "VENDOR SPECIFIC", "COPY ABORTED", "ABORTED COMMAND",
+		"RESERVED", "VOLUME OVERFLOW", "MISCOMPARE", "COMPLETED"
+	};
+	return names[sense_key & 0x0F];
+}
+
+
+void print_command_error(const char *call, int result) {
+	if(!last_sense[0] && !last_sense[1] && !last_sense[2]) {
+		fprintf(stderr, "Error while %s: %d\n", call, result);
+		return;
+	}
+
+	fprintf(stderr, "Error while %s: %d (%s, ASC/ASCQ %02X/%02X)%s\n", call, result,
+			get_sense_key_name(last_sense[0]), last_sense[1], last_sense[2],
+			last_sense[0] == 0x05 ? " - not supported by the drive" : "");
+}
+
+
+int scsi_execute_once(int fd, struct scsi_cmd *cmd) {
+	cmd->data_in_len = 0;
+	cmd->sense_len = 0;
+
+	DTRACE_PROBE3(leetcmd, command__submit, cmd->cdb[0], get_command_page(cmd), device_name);
+	uint64_t start = get_time_us();
+	int result = transport->execute(fd, cmd);
+	cmd->latency_us = get_time_us() - start;
+	DTRACE_PROBE4(leetcmd, command__complete, cmd->cdb[0], get_command_page(cmd), result, cmd->latency_us);
+
+	trace_command(cmd, result, start);
+	if(record_file)
+		trace_write(cmd, result);
+	if(result == 0) {
+		add_latency(&drive_latency, cmd->cdb[0], get_command_page(cmd), cmd->latency_us);
+		add_latency(&bridge_latency, cmd->cdb[0], get_command_page(cmd), cmd->latency_us);
+	}
+
+	return result;
+}
+
+
+int scsi_execute(int fd, struct scsi_cmd *cmd) {
+	uint64_t backoff_ms = NOT_READY_BACKOFF_MS;
+	int retried = 0;
+	int backoffs = 0;
+	uint8_t sense_key = 0;
+	uint8_t asc = 0;
+	uint8_t ascq = 0;
+	int result;
+
+	commands_issued++;
+	while(1) {
+		result = scsi_execute_once(fd, cmd);
+		if(result == 0)
+			break;
+
+		get_sense(cmd, &sense_key, &asc, &ascq);
+		enum sense_action action = classify_sense(sense_key, asc, ascq);
+		if(action == SENSE_RETRY && !retried) {
+			if(opt_verbose)
+				printf("Unit attention %02X/%02X - retrying\n", asc, ascq);
+			retried = 1;
+			continue;
+		}
+		if(action == SENSE_BACKOFF && backoffs < NOT_READY_RETRIES) {
+			printf("Drive not ready (%02X/%02X) - retrying in %llu ms\n", asc, ascq, (unsigned long long) backoff_ms);
+			sleep_ms(backoff_ms);
+			backoff_ms *= 2;
+			backoffs++;
+			continue;
+		}
+		break;
+	}
+
+	if(result != 0) {
+		last_sense[0] = sense_key;
+		last_sense[1] = asc;
+		last_sense[2] = ascq;
+		command_failures++;
+	}
+
+	return result;
+}
+
+
+int scsi_inquiry(int fd, uint8_t *resp, size_t len) {
+	struct scsi_cmd cmd = {.cdb = {0x12, 0x00, 0x00, len >> 8, len & 0xFF, 0x00}, .data_in = resp, .data_len = len};
+	return scsi_execute(fd, &cmd);
+}
+
+
+int scsi_mode_sense6(int fd, int dbd, int pc, int page, int subpage, uint8_t *resp, size_t len) {
+	struct scsi_cmd cmd = {.cdb = {0x1A, dbd ? 0x08 : 0x00, (pc << 6) | page, subpage, len, 0x00}, .data_in = resp, .data_len = len};
+	return scsi_execute(fd, &cmd);
+}
+
+
+int scsi_mode_select6(int fd, int pf, int sp, const uint8_t *param, size_t len) {
+	struct scsi_cmd cmd = {.cdb = {0x15, (pf ? 0x10 : 0x00) | (sp ? 0x01 : 0x00), 0x00, 0x00, len, 0x00}, .data_out = param, .data_len = len};
+	return scsi_execute(fd, &cmd);
+}
+
+
+int scsi_receive_diag(int fd, int pcv, int page, uint8_t *resp, size_t len) {
+	struct scsi_cmd cmd = {.cdb = {0x1C, pcv ? 0x01 : 0x00, page, len >> 8, len & 0xFF, 0x00}, .data_in = resp, .data_len = len};
+	return scsi_execute(fd, &cmd);
+}
+
+
+int scsi_send_diag(int fd, int pf, const uint8_t *param, size_t len) {
+	struct scsi_cmd cmd = {.cdb = {0x1D, pf ? 0x10 : 0x00, 0x00, len >> 8, len & 0xFF, 0x00}, .data_out = param, .data_len = len};
+	return scsi_execute(fd, &cmd);
+}
+
+
+/*
+ * idle-window scheduling
+ *
+ * The display device is a separate LUN behind the same USB bridge as the
+ * disk itself, so non-urgent updates are held back until the disk LUN has
+ * neither requests in flight nor transferred sectors for a short window.
+ */
+
+struct disk_stat {
+	uint64_t sectors;
+	uint64_t in_flight;
+};
+
+
+int find_disk_stat_path(const char *device, char *path, size_t len) {
+	struct stat st;
+	if(stat(device, &st))
+		return 1;
+
+	char pattern[256];
+	if(S_ISBLK(st.st_mode)) {
+		// whole disk, also if a partition was specified
+		snprintf(pattern, sizeof(pattern), "/sys/dev/block/%u:%u/partition", major(st.st_rdev), minor(st.st_rdev));
+		if(access(pattern, F_OK))
+			snprintf(pattern, sizeof(pattern), "/sys/dev/block/%u:%u/stat", major(st.st_rdev), minor(st.st_rdev));
+		else
+			snprintf(pattern, sizeof(pattern), "/sys/dev/block/%u:%u/../stat", major(st.st_rdev), minor(st.st_rdev));
+	} else if(S_ISCHR(st.st_mode)) {
+		// SCSI generic node: any LUN of the same target that is a disk
+		snprintf(pattern, sizeof(pattern), "/sys/dev/char/%u:%u/device/../*/block/*/stat", major(st.st_rdev), minor(st.st_rdev));
+	} else {
+		return 1;
+	}
+
+	glob_t g;
+	if(glob(pattern, 0, NULL, &g))
+		return 1;
+	snprintf(path, len, "%s", g.gl_pathv[0]);
+	globfree(&g);
+
+	return 0;
+}
+
+
+int read_disk_stat(const char *path, struct disk_stat *ds) {
+	FILE *f = fopen(path, "r");
+	if(!f)
+		return 1;
+
+	// see Documentation/block/stat.rst
+	unsigned long long v[9];
+	int fields = fscanf(f, "%llu %llu %llu %llu %llu %llu %llu %llu %llu", &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7], &v[8]);
+	fclose(f);
+	if(fields != 9)
+		return 1;
+
+	ds->sectors = v[2] + v[6];
+	ds->in_flight = v[8];
+	return 0;
+}
+
+
+void wait_for_idle(const char *opt_device, int window_ms, int max_defer_ms) {
+	char path[256];
+	if(find_disk_stat_path(opt_device, path, sizeof(path))) {
+		fprintf(stderr, "Cannot find disk statistics for %s - not deferring\n", opt_device);
+		return;
+	}
+	if(opt_verbose)
+		printf("Waiting for %d ms of idle time on %s...\n", window_ms, path);
+
+	uint64_t step_ms = window_ms / 5 ? window_ms / 5 : 1;
+	uint64_t start = get_time_ms();
+	uint64_t idle_since = start;
+	struct disk_stat last;
+	if(read_disk_stat(path, &last))
+		return;
+
+	for(;;) {
+		uint64_t now = get_time_ms();
+		if(now - idle_since >= (uint64_t) window_ms)
+			break;
+		if(now - start >= (uint64_t) max_defer_ms) {
+			if(opt_verbose)
+				printf("Drive not idle after %d ms - updating anyway\n", max_defer_ms);
+			break;
+		}
+
+		sleep_ms(step_ms);
+
+		struct disk_stat cur;
+		if(read_disk_stat(path, &cur))
+			return;
+		if(cur.in_flight || cur.sectors != last.sectors)
+			idle_since = get_time_ms();
+		last = cur;
+	}
+
+	if(opt_verbose)
+		printf("Deferred by %llu ms\n", (unsigned long long) (get_time_ms() - start));
+}
+
+
+void set_idle_io_priority() {
+	int result = syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+	if(result)
+		perror("Error while ioprio_set");
+}
+
+
+/*
+ * free space from file system superblocks
+ *
+ * For unmounted volumes the free/total block counters are read directly
+ * from the superblock, which lies within the first 4 KiB for all supported
+ * file systems. A mounted file system keeps its counters in memory and
+ * writes them back lazily, so its mount point is asked instead. NTFS keeps
+ * no free cluster counter outside its $Bitmap, so it is not supported.
+ */
+
+uint64_t get_le(const uint8_t *data, size_t len) {
+	uint64_t value = 0;
+	while(len--)
+		value = (value << 8) | data[len];
+	return value;
+}
+
+
+uint64_t get_be(const uint8_t *data, size_t len) {
+	uint64_t value = 0;
+	size_t i;
+	for(i = 0; i < len; i++)
+		value = (value << 8) | data[i];
+	return value;
+}
+
+
+int parse_superblock(const uint8_t *data, uint64_t *bytes_free, uint64_t *bytes_total) {
+	// ext2/3/4: superblock at offset 1024, little endian
+	const uint8_t *ext = data + 1024;
+	if(get_le(ext + 0x38, 2) == 0xEF53) {
+		uint64_t block_size = 1024ULL << get_le(ext + 0x18, 4);
+		uint64_t blocks = get_le(ext + 0x04, 4);
+		uint64_t blocks_free = get_le(ext + 0x0C, 4);
+		if(get_le(ext + 0x60, 4) & 0x80) {	// INCOMPAT_64BIT
+			blocks |= get_le(ext + 0x150, 4) << 32;
+			blocks_free |= get_le(ext + 0x158, 4) << 32;
+		}
+		if(opt_verbose)
+			printf("Superblock: ext2/3/4\n");
+		*bytes_free = blocks_free * block_size;
+		*bytes_total = blocks * block_size;
+		return 0;
+	}
+
+	// XFS: superblock at offset 0, big endian
+	if(!memcmp(data, "XFSB", 4)) {
+		uint64_t block_size = get_be(data + 4, 4);
+		uint64_t blocks = get_be(data + 8, 8);
+		uint64_t blocks_free = get_be(data + 144, 8);
+		if(get_be(data + 48, 8))			// internal log
+			blocks -= get_be(data + 96, 4);
+		if(opt_verbose)
+			printf("Superblock: XFS\n");
+		*bytes_free = blocks_free * block_size;
+		*bytes_total = blocks * block_size;
+		return 0;
+	}
+
+	// exFAT: boot sector at offset 0, little endian; usage only in percent
+	if(!memcmp(data + 3, "EXFAT   ", 8)) {
+		uint64_t cluster_size = 1ULL << (data[108] + data[109]);
+		uint64_t clusters = get_le(data + 92, 4);
+		uint8_t percent_in_use = data[112];
+		if(percent_in_use > 100) {
+			fprintf(stderr, "exFAT volume does not record its usage\n");
+			return 1;
+		}
+		if(opt_verbose)
+			printf("Superblock: exFAT\n");
+		*bytes_total = clusters * cluster_size;
+		*bytes_free = *bytes_total / 100 * (100 - percent_in_use);
+		return 0;
+	}
+
+	fprintf(stderr, "Unsupported file system\n");
+	return 1;
+}
+
+
+int read_superblock_space(const char *path, uint64_t *bytes_free, uint64_t *bytes_total) {
+	// bypass the page cache, if possible
+	int fd = open(path, O_RDONLY | O_DIRECT);
+	if(fd < 0 && errno == EINVAL)
+		fd = open(path, O_RDONLY);
+	if(fd < 0) {
+		perror("Error while opening file system");
+		return 1;
+	}
+
+	uint8_t *data;
+	if(posix_memalign((void**) &data, SUPERBLOCK_READ_LEN, SUPERBLOCK_READ_LEN)) {
+		close(fd);
+		fprintf(stderr, "Error while allocating superblock buffer\n");
+		return 1;
+	}
+
+	int result = 1;
+	if(pread(fd, data, SUPERBLOCK_READ_LEN, 0) != SUPERBLOCK_READ_LEN)
+		perror("Error while reading superblock");
+	else
+		result = parse_superblock(data, bytes_free, bytes_total);
+
+	free(data);
+	close(fd);
+	return result;
+}
+
+
+// undo the octal escapes of mountinfo in place
+void unescape_mount_point(char *text) {
+	char *out = text;
+	while(*text) {
+		if(text[0] == '\\' && text[1] >= '0' && text[1] <= '3' && text[2] >= '0' && text[2] <= '7' && text[3] >= '0' && text[3] <= '7') {
+			*out++ = (text[1] - '0') << 6 | (text[2] - '0') << 3 | (text[3] - '0');
+			text += 4;
+		} else {
+			*out++ = *text++;
+		}
+	}
+	*out = 0x00;
+}
+
+
+// 1: <dev> is not mounted
+int find_mount_point(dev_t dev, char *point) {
+	FILE *f = fopen("/proc/self/mountinfo", "re");
+	if(!f)
+		return 1;
+
+	int result = 1;
+	char *line = NULL;
+	size_t line_len = 0;
+	while(result && getline(&line, &line_len, f) > 0) {
+		unsigned int dev_major;
+		unsigned int dev_minor;
+		if(sscanf(line, "%*d %*d %u:%u %*s %4095s", &dev_major, &dev_minor, point) == 3 && makedev(dev_major, dev_minor) == dev)
+			result = 0;
+	}
+	free(line);
+	fclose(f);
+
+	if(!result)
+		unescape_mount_point(point);
+	return result;
+}
+
+
+int get_space(const char *path, uint64_t *bytes_free, uint64_t *bytes_total) {
+	struct stat path_info;
+	char point[PATH_MAX];
+	if(!stat(path, &path_info) && S_ISBLK(path_info.st_mode)) {
+		if(find_mount_point(path_info.st_rdev, point))
+			return read_superblock_space(path, bytes_free, bytes_total);
+		if(opt_verbose)
+			printf("%s is mounted on %s\n", path, point);
+		path = point;
+	}
+
+	struct statvfs space_info;
+	int statvfs_result = statvfs(path, &space_info);
+	if(statvfs_result) {
+		perror("Error while statvfs");
+		return 1;
+	}
+
+	*bytes_free = space_info.f_bfree;
+	*bytes_free *= space_info.f_frsize;
+
+	*bytes_total = space_info.f_blocks;
+	*bytes_total *= space_info.f_frsize;
+	DTRACE_PROBE3(leetcmd, space__statvfs, path, *bytes_free, *bytes_total);
+
+	return 0;
+}
+
+
+/*
+ * free space probes
+ *
+ * A hung network or FUSE mount blocks statvfs indefinitely, so probes run on
+ * a detached worker thread and are waited for until a deadline only. A probe
+ * that missed its deadline is left to finish on its own; it is shared by
+ * reference count, and no further probe of the same path is started while
+ * it is still stuck.
+ */
+
+struct space_probe {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int refs;				// worker + owner
+	int done;
+	int result;
+	uint64_t bytes_free;
+	uint64_t bytes_total;
+	char path[PATH_MAX];
+};
+
+static int opt_space_timeout = SPACE_TIMEOUT_DEFAULT_MS;
+
+
+void release_space_probe(struct space_probe *probe) {
+	pthread_mutex_lock(&probe->mutex);
+	int refs = --probe->refs;
+	pthread_mutex_unlock(&probe->mutex);
+	if(refs)
+		return;
+
+	pthread_cond_destroy(&probe->cond);
+	pthread_mutex_destroy(&probe->mutex);
+	free(probe);
+}
+
+
+void* run_space_probe(void *arg) {
+	struct space_probe *probe = arg;
+	uint64_t bytes_free = 0;
+	uint64_t bytes_total = 0;
+	int result = get_space(probe->path, &bytes_free, &bytes_total);
+
+	pthread_mutex_lock(&probe->mutex);
+	probe->result = result;
+	probe->bytes_free = bytes_free;
+	probe->bytes_total = bytes_total;
+	probe->done = 1;
+	pthread_cond_signal(&probe->cond);
+	pthread_mutex_unlock(&probe->mutex);
+
+	release_space_probe(probe);
+	return NULL;
+}
+
+
+struct space_probe* start_space_probe(const char *path) {
+	struct space_probe *probe = calloc(1, sizeof(*probe));
+	if(!probe) {
+		perror("Error while malloc");
+		return NULL;
+	}
+	snprintf(probe->path, sizeof(probe->path), "%s", path);
+	probe->refs = 2;
+
+	// deadlines are on CLOCK_MONOTONIC, like get_time_ms()
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&probe->cond, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_mutex_init(&probe->mutex, NULL);
+
+	pthread_t thread;
+	pthread_attr_t thread_attr;
+	pthread_attr_init(&thread_attr);
+	pthread_attr_setdetachstate(&thread_attr, PTHREAD_CREATE_DETACHED);
+	int result = pthread_create(&thread, &thread_attr, run_space_probe, probe);
+	pthread_attr_destroy(&thread_attr);
+	if(result) {
+		// probe in place instead
+		probe->refs = 1;
+		probe->result = get_space(path, &probe->bytes_free, &probe->bytes_total);
+		probe->done = 1;
+	}
+
+	return probe;
+}
+
+
+// 0: done, PROBE_TIMED_OUT: still running at deadline_ms
+int wait_space_probe(struct space_probe *probe, uint64_t deadline_ms, uint64_t *bytes_free, uint64_t *bytes_total) {
+	struct timespec ts;
+	ts.tv_sec = deadline_ms / 1000;
+	ts.tv_nsec = (deadline_ms % 1000) * 1000000;
+
+	pthread_mutex_lock(&probe->mutex);
+	while(!probe->done && pthread_cond_timedwait(&probe->cond, &probe->mutex, &ts) != ETIMEDOUT)
+		;
+	int result = probe->done ? probe->result : PROBE_TIMED_OUT;
+	*bytes_free = probe->bytes_free;
+	*bytes_total = probe->bytes_total;
+	pthread_mutex_unlock(&probe->mutex);
+
+	if(result == PROBE_TIMED_OUT)
+		fprintf(stderr, "Free space of %s not available within %d ms\n", probe->path, opt_space_timeout);
+	return result;
+}
+
+
+// probe of a path that may hang; *pending keeps a stuck probe across calls
+int get_space_timed(struct space_probe **pending, const char *path, uint64_t *bytes_free, uint64_t *bytes_total) {
+	if(*pending) {
+		// a late result is still the most recent one
+		int result = PROBE_TIMED_OUT;
+		pthread_mutex_lock(&(*pending)->mutex);
+		if((*pending)->done) {
+			result = (*pending)->result;
+			*bytes_free = (*pending)->bytes_free;
+			*bytes_total = (*pending)->bytes_total;
+		}
+		pthread_mutex_unlock(&(*pending)->mutex);
+		if(result == PROBE_TIMED_OUT)
+			return result;
+
+		release_space_probe(*pending);
+		*pending = NULL;
+		return result;
+	}
+
+	struct space_probe *probe = start_space_probe(path);
+	if(!probe)
+		return get_space(path, bytes_free, bytes_total);
+
+	int result = wait_space_probe(probe, get_time_ms() + opt_space_timeout, bytes_free, bytes_total);
+	if(result == PROBE_TIMED_OUT)
+		*pending = probe;
+	else
+		release_space_probe(probe);
+	return result;
+}
+
+
+/*
+ * refresh accounting
+ *
+ * Every page write causes a physical refresh of the panel, so writes are
+ * counted per page and limited by a token bucket of <budget> writes per
+ * <period>. Counters and bucket are persisted per drive, so the budget also
+ * holds across one-shot runs.
+ */
+
+static const uint8_t ACCOUNTED_PAGES[] = {0x20, 0x21, 0x86, 0x87};
+#define ACCOUNTED_PAGES_COUNT (sizeof(ACCOUNTED_PAGES) / sizeof(ACCOUNTED_PAGES[0]))
+
+struct write_stats {
+	uint64_t writes[ACCOUNTED_PAGES_COUNT];
+	uint64_t over_budget;
+	double tokens;
+	int64_t refill_time;
+};
+
+static __thread struct write_stats write_stats;
+static __thread char write_stats_path[PATH_MAX];	// empty: not persisted
+static int opt_budget = 0;					// 0: unlimited
+static int opt_budget_period = BUDGET_PERIOD_DEFAULT_S;
+
+
+void load_write_stats(const char *path) {
+	snprintf(write_stats_path, sizeof(write_stats_path), "%s", path);
+
+	memset(&write_stats, 0x00, sizeof(write_stats));
+	write_stats.tokens = opt_budget;
+	write_stats.refill_time = time(NULL);
+
+	FILE *f = fopen(path, "r");
+	if(!f)
+		return;
+
+	char key[64];
+	char value[64];
+	while(fscanf(f, "%63s %63s", key, value) == 2) {
+		unsigned int page;
+		size_t i;
+		if(sscanf(key, "writes_page_%x", &page) == 1) {
+			for(i = 0; i < ACCOUNTED_PAGES_COUNT; i++)
+				if(ACCOUNTED_PAGES[i] == page)
+					write_stats.writes[i] = strtoull(value, NULL, 10);
+		} else if(!strcmp(key, "writes_over_budget")) {
+			write_stats.over_budget = strtoull(value, NULL, 10);
+		} else if(!strcmp(key, "tokens")) {
+			write_stats.tokens = strtod(value, NULL);
+		} else if(!strcmp(key, "refill_time")) {
+			write_stats.refill_time = strtoll(value, NULL, 10);
+		}
+	}
+	fclose(f);
+}
+
+
+void print_write_stats(FILE *f) {
+	size_t i;
+	for(i = 0; i < ACCOUNTED_PAGES_COUNT; i++)
+		fprintf(f, "writes_page_%02x %llu\n", ACCOUNTED_PAGES[i], (unsigned long long) write_stats.writes[i]);
+	fprintf(f, "writes_over_budget %llu\n", (unsigned long long) write_stats.over_budget);
+	fprintf(f, "tokens %.3f\n", write_stats.tokens);
+	fprintf(f, "refill_time %lld\n", (long long) write_stats.refill_time);
+}
+
+
+void save_write_stats() {
+	if(!write_stats_path[0])
+		return;
+
+	char tmp_path[PATH_MAX + 4];
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", write_stats_path);
+	FILE *f = fopen(tmp_path, "w");
+	if(!f) {
+		perror("Error while saving write statistics");
+		return;
+	}
+	print_write_stats(f);
+	if(fclose(f) || rename(tmp_path, write_stats_path))
+		perror("Error while saving write statistics");
+}
+
+
+// 1: write may be issued
+int take_write_token(uint8_t page) {
+	if(!opt_budget)
+		return 1;
+
+	// refill
+	int64_t now = time(NULL);
+	if(now > write_stats.refill_time) {
+		write_stats.tokens += (double) (now - write_stats.refill_time) * opt_budget / opt_budget_period;
+		write_stats.refill_time = now;
+	}
+	if(write_stats.tokens > opt_budget)
+		write_stats.tokens = opt_budget;
+
+	if(write_stats.tokens >= 1.0) {
+		write_stats.tokens -= 1.0;
+		return 1;
+	}
+
+	printf("Write budget exhausted - page 0x%02X not written\n", page);
+	write_stats.over_budget++;
+	save_write_stats();
+	return 0;
+}
+
+
+void count_write(uint8_t page) {
+	size_t i;
+	for(i = 0; i < ACCOUNTED_PAGES_COUNT; i++)
+		if(ACCOUNTED_PAGES[i] == page)
+			write_stats.writes[i]++;
+	save_write_stats();
+}
+
+
+/*
+ * display history
+ *
+ * Every write of a display page, issued or skipped, leaves a record in a
+ * fixed-size ring file per drive, mapped into memory. A record holds the
+ * whole display as it would look after the write: free space page, label
+ * and flags. The drive lock makes its holder the only writer, so appending
+ * is a copy and a sequence bump, without locks or system calls. Readers
+ * check the sequence of a record before and after copying it.
+ */
+
+enum history_outcome {
+	HISTORY_WRITTEN,
+	HISTORY_UNCHANGED,		// already shown
+	HISTORY_BUDGET,			// skipped: write budget exhausted
+	HISTORY_INTERVAL,		// skipped: label interval not over
+	HISTORY_FAILED
+};
+
+enum {
+	HISTORY_KNOWN_DISABLE_VCD = 0x01,
+	HISTORY_KNOWN_INVERSE = 0x02,
+	HISTORY_KNOWN_SPACE = 0x04,
+	HISTORY_KNOWN_LABEL = 0x08
+};
+
+struct history_entry {
+	uint64_t seq;			// 0: unused, odd: being written
+	int64_t time_ms;		// wall clock
+	uint8_t page;			// page written or skipped
+	uint8_t outcome;
+	uint8_t known;			// HISTORY_KNOWN_* of the fields below
+	uint8_t flags;			// bit 0: disable VCD, bit 1: inverse display
+	uint8_t space_page[SPACE_PAGE_LEN];
+	uint8_t label[LABEL_LEN_RAW];
+};
+
+struct history_file {
+	char magic[8];
+	uint32_t entry_len;
+	uint32_t entries;
+	uint64_t head;			// records appended so far
+	uint8_t reserved[40];
+	struct history_entry ring[HISTORY_LEN];
+};
+
+// mapped ring of the drive this thread talks to, and what its display shows
+static __thread struct history_file *history = NULL;
+static __thread uint64_t history_key = 0;
+static __thread struct history_entry display_shown;
+
+
+// data: page as read or written, with header
+void set_display_page(struct history_entry *state, uint8_t page, const uint8_t *data) {
+	switch(page) {
+	case 0x20:
+		state->known |= HISTORY_KNOWN_DISABLE_VCD;
+		state->flags = (state->flags & ~0x01) | get_bit(data + 6, 2, 1);
+		break;
+	case 0x21:
+		state->known |= HISTORY_KNOWN_INVERSE;
+		state->flags = (state->flags & ~0x02) | get_bit(data + 6, 8, 0) << 1;
+		break;
+	case 0x86:
+		state->known |= HISTORY_KNOWN_SPACE;
+		memcpy(state->space_page, data, SPACE_PAGE_LEN);
+		break;
+	case 0x87:
+		state->known |= HISTORY_KNOWN_LABEL;
+		memcpy(state->label, data + 4 + 8, LABEL_LEN_RAW);
+		break;
+	}
+}
+
+
+// page read from the drive
+void note_display(uint8_t page, const uint8_t *data) {
+	if(history)
+		set_display_page(&display_shown, page, data);
+}
+
+
+void append_history(const struct history_entry *entry) {
+	uint64_t head = __atomic_load_n(&history->head, __ATOMIC_ACQUIRE);
+
+	// repeated skips of the same content only once
+	if(head) {
+		const struct history_entry *last = &history->ring[(head - 1) % HISTORY_LEN];
+		size_t offset = offsetof(struct history_entry, page);
+		if(entry->outcome != HISTORY_WRITTEN && __atomic_load_n(&last->seq, __ATOMIC_ACQUIRE) == head * 2
+				&& !memcmp((const uint8_t*) last + offset, (const uint8_t*) entry + offset, sizeof(*entry) - offset))
+			return;
+	}
+
+	// reserved, in case instances run with --no-lock
+	uint64_t seq = __atomic_add_fetch(&history->head, 1, __ATOMIC_ACQ_REL);
+	struct history_entry *slot = &history->ring[(seq - 1) % HISTORY_LEN];
+
+	// odd while being written, so a concurrent reader skips the record
+	__atomic_store_n(&slot->seq, seq * 2 - 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy((uint8_t*) slot + sizeof(slot->seq), (const uint8_t*) entry + sizeof(entry->seq), sizeof(*entry) - sizeof(entry->seq));
+	__atomic_store_n(&slot->seq, seq * 2, __ATOMIC_RELEASE);
+}
+
+
+// data: page as to be written, with header
+void record_display(uint8_t page, const uint8_t *data, enum history_outcome outcome) {
+	if(!history)
+		return;
+
+	struct timespec ts;
+	struct history_entry entry = display_shown;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	entry.time_ms = (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+	entry.page = page;
+	entry.outcome = outcome;
+	set_display_page(&entry, page, data);
+	append_history(&entry);
+
+	if(outcome == HISTORY_WRITTEN || outcome == HISTORY_UNCHANGED)
+		display_shown = entry;
+}
+
+
+struct device_info {
+	char vendor[9];
+	char product[17];
+	char revision[5];
+};
+
+
+int inquire_device(struct device_info *info) {
+	uint8_t inquiry[INQUIRY_LEN];
+
+	if(opt_verbose)
+		printf("Reading device information...\n");
+	memset(inquiry, 0x00, sizeof(inquiry));
+	int result = scsi_inquiry(device_fd, inquiry, sizeof(inquiry));
+	if(result != 0) {
+		print_command_error("scsi_inquiry", result);
+		return 1;
+	}
+
+	// standard INQUIRY data
+	memcpy(info->vendor, inquiry + 8, 8);
+	info->vendor[8] = 0x00;
+	memcpy(info->product, inquiry + 16, 16);
+	info->product[16] = 0x00;
+	memcpy(info->revision, inquiry + 32, 4);
+	info->revision[4] = 0x00;
+
+	return 0;
+}
+
+
+int is_supported_model(const struct device_info *info) {
+	const char** model = SUPPORTED_MODELS;
+	while(*model) {
+		if(!strcmp(info->vendor, model[0]) && !strcmp(info->product, model[1]))
+			return 1;
+		model += 2;
+	}
+	return 0;
+}
+
+
+int report_device(const char *opt_device, int opt_force, const struct device_info *info, int cached) {
+	int valid = is_supported_model(info);
+	const char* check_result_text = valid ? (cached ? "supported; cached" : "supported") : (opt_force ? "unsupported; continuing forced" : "unsupported; aborting");
+	int check_result = (valid || opt_force) ? 0 : 1;
+	FILE *target = check_result ? stderr : stdout;
+
+	fprintf(target, "Device: %s (%s)\n", opt_device, check_result_text);
+	fprintf(target, "%s - %s (rev %s)\n", info->vendor, info->product, info->revision);
+
+	return check_result;
+}
+
+
+int check_device(const char *opt_device, int opt_force) {
+	struct device_info info;
+	if(inquire_device(&info))
+		return 1;
+
+	return report_device(opt_device, opt_force, &info, 0);
+}
+
+
+// pc: 0 current, 3 saved values
+int read_mode_page(const char *name, uint8_t page, int pc, uint8_t *data, size_t result_len) {
+	int result;
+
+	// load setting
+	if(opt_verbose)
+		printf("Reading %s value...\n", name);
+	result = scsi_mode_sense6(device_fd, 1, pc, page, 0x00, data, 6 + result_len);
+	if(result != 0) {
+		print_command_error("scsi_mode_sense6", result);
+		return 1;
+	}
+
+
+	if(check_mode_page(data, page, result_len)) {
+		fprintf(stderr, "Error getting %s value - aborting!\n", name);
+		return 1;
+	}
+	if(pc == 0)
+		note_display(page, data);
+
+	return 0;
+}
+
+
+// save: 0 changes the current value only, until the next power cycle or revert
+int handle_mode_page_flag_value(int opt_flag, int save, const char *name, uint8_t page, size_t result_len, size_t flag_offset, size_t flag_bit) {
+	int result;
+	uint8_t data[6 + result_len];
+	uint8_t* page_data = data + 6;
+
+	if(read_mode_page(name, page, 0, data, result_len))
+		return 1;
+
+	int flag_value = get_bit(page_data, flag_offset, flag_bit);
+
+	if(opt_flag != -1 && flag_value != opt_flag) {
+		// reset PS flag (as reserved when using MODE SELECT)
+		data[4] &= 0x7F;
+
+		set_bit(page_data, flag_offset, flag_bit, opt_flag);
+		printf("%s state: %d -> %d%s\n", name, flag_value, opt_flag, save ? "" : " (transient)");
+
+		// save setting
+		if(!take_write_token(page)) {
+			record_display(page, data, HISTORY_BUDGET);
+			return 0;
+		}
+		if(opt_verbose)
+			printf("Writing %s value...\n", name);
+		result = scsi_mode_select6(device_fd, 1, save, data, sizeof(data));
+		if(result != 0) {
+			print_command_error("scsi_mode_select6", result);
+			record_display(page, data, HISTORY_FAILED);
+			return 1;
+		}
+		count_write(page);
+		record_display(page, data, HISTORY_WRITTEN);
+	} else {
+		printf("%s state: %d%s\n", name, flag_value, flag_value == opt_flag ? " (already)" : "");
+		if(flag_value == opt_flag)
+			record_display(page, data, HISTORY_UNCHANGED);
+	}
+
+	return 0;
+}
+
+
+// 1: current and saved values differ; saved is left in data
+int mode_page_differs_from_saved(const char *name, uint8_t page, uint8_t *data, size_t result_len, int *differs) {
+	uint8_t current[6 + result_len];
+
+	if(read_mode_page(name, page, 0, current, result_len) || read_mode_page(name, page, 3, data, result_len))
+		return 1;
+	*differs = memcmp(current + 6, data + 6, result_len) != 0;
+	return 0;
+}
+
+
+// the flag is printed from the saved page, no need to read it back
+int revert_mode_page(const char *name, uint8_t page, size_t result_len, size_t flag_offset, size_t flag_bit) {
+	uint8_t data[6 + result_len];
+	int differs;
+
+	if(mode_page_differs_from_saved(name, page, data, result_len, &differs))
+		return 1;
+	int flag_value = get_bit(data + 6, flag_offset, flag_bit);
+	if(!differs) {
+		printf("%s state: %d (saved, already current)\n", name, flag_value);
+		return 0;
+	}
+
+	// current values only, the saved ones are what we restore
+	data[4] &= 0x7F;
+	printf("%s state: %d (reverted to saved)\n", name, flag_value);
+	if(!take_write_token(page)) {
+		record_display(page, data, HISTORY_BUDGET);
+		return 0;
+	}
+	int result = scsi_mode_select6(device_fd, 1, 0, data, sizeof(data));
+	if(result != 0) {
+		print_command_error("scsi_mode_select6", result);
+		record_display(page, data, HISTORY_FAILED);
+		return 1;
+	}
+	count_write(page);
+	record_display(page, data, HISTORY_WRITTEN);
+
+	return 0;
+}
+
+
+void print_label(const uint8_t *data) {
+	int i;
+	int j;
+	uint8_t lines[5][72];
+
+	// init output
+	memset(lines, 0x20, 5 * 72);
+
+	// prepare output
+	int term_offset = 0;
+	for(i = 0; i < 12; i++) {
+		uint16_t char_value = (data[i * 2] << 8) | data[i * 2 + 1];
+
+		// if no segment displayed, skip digit
+		if(char_value == 0x0000)
+			continue;
+
+		// map segments
+		int col_offset = i * 6;
+		for(j = 0; j < 14; j++) {
+			if(char_value & (1 << j)) {
+				const struct SEGMENT_MAPPING* m = &segment_mappings[j];
+				memcpy(&lines[m->row_offset][col_offset + m->col_offset], m->text, strlen(m->text));
+			}
+		}
+		term_offset = col_offset + 5;
+	}
+
+	// set terminator + print output
+	for(i = 0; i < 5; i++) {
+		lines[i][term_offset] = 0x00;
+		printf("%s\n", lines[i]);
+	}
+}
+
+
+int get_label_char(char c) {
+	if(c < LABEL_ASCII_CHARS_START || c > LABEL_ASCII_CHARS_END)
+		return -1;
+
+	return LABEL_ASCII_CHARS[c - LABEL_ASCII_CHARS_START];
+}
+
+
+int read_label_page(uint8_t *data) {
+	int result;
+
+	// load setting
+	if(opt_verbose)
+		printf("Reading label value...\n");
+	result = scsi_receive_diag(device_fd, 1, 0x87, data, LABEL_PAGE_LEN);
+	if(result != 0) {
+		print_command_error("scsi_receive_diag", result);
+		return 1;
+	}
+
+
+	if(check_diag_page(data, 0x87, 8 + LABEL_LEN_RAW)) {
+		fprintf(stderr, "Error getting label value - aborting!\n");
+		return 1;
+	}
+	note_display(0x87, data);
+
+	return 0;
+}
+
+
+int write_label_page(const uint8_t *data) {
+	int result;
+
+	// save setting
+	if(!take_write_token(0x87)) {
+		DTRACE_PROBE1(leetcmd, label__skip, "budget");
+		record_display(0x87, data, HISTORY_BUDGET);
+		return WRITE_DEFERRED;
+	}
+	DTRACE_PROBE1(leetcmd, label__write, data + 4 + 8);
+	if(opt_verbose)
+		printf("Writing label value...\n");
+	result = scsi_send_diag(device_fd, 1, data, LABEL_PAGE_LEN);
+	if(result != 0) {
+		print_command_error("scsi_send_diag", result);
+		record_display(0x87, data, HISTORY_FAILED);
+		return 1;
+	}
+	count_write(0x87);
+	record_display(0x87, data, HISTORY_WRITTEN);
+
+	return 0;
+}
+
+
+int handle_label_value(const uint8_t* label) {
+	uint8_t data[LABEL_PAGE_LEN];
+	uint8_t* page_data = data + 4;
+	uint8_t* label_data = page_data + 8;
+
+	if(read_label_page(data))
+		return 1;
+
+	printf("Label:\n");
+	print_label(label_data);
+
+	// return, if no new label
+	if(!label)
+		return 0;
+
+	// return, if no change
+	if(!memcmp(label_data, label, LABEL_LEN_RAW)) {
+		DTRACE_PROBE1(leetcmd, label__skip, "unchanged");
+		record_display(0x87, data, HISTORY_UNCHANGED);
+		return 0;
+	}
+
+	memcpy(label_data, label, LABEL_LEN_RAW);
+
+	printf("New label:\n");
+	print_label(label_data);
+
+	return write_label_page(data) == 1;
+}
+
+
+int read_space_page(uint8_t *data) {
+	int result;
+
+	// load page content
+	if(opt_verbose)
+		printf("Reading page content...\n");
+	result = scsi_receive_diag(device_fd, 1, 0x86, data, SPACE_PAGE_LEN);
+	if(result != 0) {
+		print_command_error("scsi_receive_diag", result);
+		return 1;
+	}
+	note_display(0x86, data);
+
+	return 0;
+}
+
+
+int write_space_page(const uint8_t *data) {
+	int result;
+
+	// save setting
+	if(!take_write_token(0x86)) {
+		record_display(0x86, data, HISTORY_BUDGET);
+		return WRITE_DEFERRED;
+	}
+	if(opt_verbose)
+		printf("Writing free space value...\n");
+	result = scsi_send_diag(device_fd, 1, data, SPACE_PAGE_LEN);
+	if(result != 0) {
+		print_command_error("scsi_send_diag", result);
+		record_display(0x86, data, HISTORY_FAILED);
+		return 1;
+	}
+	count_write(0x86);
+	record_display(0x86, data, HISTORY_WRITTEN);
+
+	return 0;
+}
+
+
+/*
+ * free space encoding
+ *
+ * Integer arithmetic only, as some NAS boards have no FPU. All values are
+ * truncated, never rounded up: a display never claims more free space than
+ * there is. The bar rounds to the nearest segment.
+ */
+
+struct space_display {
+	int shown;					// 0: cleared
+	uint8_t segments_used;		// 0..10, from the left
+	uint8_t digits[3];			// BCD, 100s to 1s
+	uint8_t digits_shown;		// bit 2: 100s, bit 1: 10s, bit 0: 1s
+	int dec_point;				// between 100s and 10s digit
+	int tb_mode;
+};
+
+
+// bar, digits and unit for free/total bytes; 1: not displayable
+int encode_space_display(uint64_t space_free, uint64_t space_total, unsigned int kb_factor, const struct space_display *previous, unsigned int hysteresis_bp, struct space_display *display) {
+	memset(display, 0x00, sizeof(*display));
+	if(!space_total)
+		return 0;
+	if(space_free > space_total)
+		space_free = space_total;
+	display->shown = 1;
+
+	// segments, in thousandths; scaled down so that free * 10000 fits
+	uint64_t scaled_free = space_free;
+	uint64_t scaled_total = space_total;
+	while(scaled_total >= (1ULL << 48)) {
+		scaled_free >>= 1;
+		scaled_total >>= 1;
+	}
+	uint64_t segments_free_milli = scaled_free * 10000 / scaled_total;
+	uint64_t segments_free = (scaled_free * 20 + scaled_total) / (scaled_total * 2);
+	display->segments_used = 10 - segments_free;
+
+	// keep the previous count until well past the rounding point
+	if(previous && previous->shown) {
+		uint64_t previous_free_milli = (uint64_t) (10 - previous->segments_used) * 1000;
+		uint64_t distance = segments_free_milli > previous_free_milli ? segments_free_milli - previous_free_milli : previous_free_milli - segments_free_milli;
+		if(distance < 500 + hysteresis_bp)
+			display->segments_used = previous->segments_used;
+	}
+
+	// hundredths of GB, TB only from 1000 GB or well below if shown before
+	uint64_t unit = (uint64_t) kb_factor * kb_factor * kb_factor;
+	if(space_free > UINT64_MAX / 100)
+		return 1;
+	uint64_t hundredths = space_free * 100 / unit;
+	uint64_t tb_threshold = 100000;
+	if(previous && previous->shown && previous->tb_mode)
+		tb_threshold = tb_threshold * (10000 - hysteresis_bp) / 10000;
+	if(hundredths >= tb_threshold) {
+		display->tb_mode = 1;
+		hundredths = space_free * 100 / (unit * kb_factor);
+	}
+	if(hundredths >= 100000)
+		return 1;
+
+	// integer format from 10, or well below if shown before in the same unit
+	uint64_t integer_threshold = 1000;
+	if(previous && previous->shown && !previous->dec_point && previous->tb_mode == display->tb_mode)
+		integer_threshold = integer_threshold * (10000 - hysteresis_bp) / 10000;
+
+	if(hundredths >= integer_threshold) {		// range '  9' to '999'
+		unsigned int value = hundredths / 100;
+		display->digits[0] = value / 100;
+		display->digits[1] = value / 10 % 10;
+		display->digits[2] = value % 10;
+		display->digits_shown = (value >= 100 ? 0x04 : 0x00) | (value >= 10 ? 0x02 : 0x00) | 0x01;
+	} else {									// range '0.00' to '9.99'
+		display->digits[0] = hundredths / 100;
+		display->digits[1] = hundredths / 10 % 10;
+		display->digits[2] = hundredths % 10;
+		display->digits_shown = 0x07;
+		display->dec_point = 1;
+	}
+
+	return 0;
+}
+
+
+void decode_space_display(const uint8_t *data, struct space_display *display) {
+	const uint8_t *page_data = data + 4;
+	int i;
+
+	memset(display, 0x00, sizeof(*display));
+	display->shown = (page_data[4] & 0x80) != 0;
+	uint16_t segments_raw = (page_data[6] << 2) | (page_data[7] >> 6);
+	for(i = 0; i < 10; i++)
+		display->segments_used += (segments_raw >> i) & 0x01;
+	for(i = 0; i < 3; i++) {
+		display->digits[i] = page_data[12 + i] & 0x0F;
+		if(page_data[12 + i] & 0x80)
+			display->digits_shown |= 0x04 >> i;
+	}
+	display->dec_point = (page_data[11] & 0x02) != 0;
+	display->tb_mode = (page_data[10] & 0x04) != 0;
+}
+
+
+void format_space_display(const struct space_display *display, char *text) {
+	int i;
+	char digits[4];
+
+	if(!display->shown) {
+		snprintf(text, SPACE_TEXT_LEN, "(cleared)");
+		return;
+	}
+	for(i = 0; i < 3; i++)
+		digits[i] = (display->digits_shown & (0x04 >> i)) ? '0' + display->digits[i] : ' ';
+	digits[3] = 0x00;
+
+	if(display->dec_point)
+		snprintf(text, SPACE_TEXT_LEN, "%c.%c%c %s", digits[0], digits[1], digits[2], display->tb_mode ? "TB" : "GB");
+	else
+		snprintf(text, SPACE_TEXT_LEN, "%s %s", digits, display->tb_mode ? "TB" : "GB");
+}
+
+
+// previous: page as last written or read, for hysteresis; NULL if unknown
+int encode_free_space(uint8_t *data, uint64_t space_free, uint64_t space_total, unsigned int kb_factor, const uint8_t *previous, char *text) {
+	uint8_t *page_data = data + 4;
+	struct space_display previous_display;
+	struct space_display display;
+	int i;
+
+	if(previous)
+		decode_space_display(previous, &previous_display);
+	if(encode_space_display(space_free, space_total, kb_factor, previous ? &previous_display : NULL, opt_hysteresis_bp, &display)) {
+		fprintf(stderr, "Free space too large for display: %llu bytes\n", (unsigned long long) space_free);
+		return 1;
+	}
+
+	// reset all bits with known meaning
+	page_data[4] &= ~(0x80);
+	page_data[6] = 0x00;
+	page_data[7] &= ~(0xC0);
+	page_data[10] &= ~(0x16);
+	page_data[11] &= ~(0x02);
+	page_data[12] &= ~(0x8F);
+	page_data[13] &= ~(0x8F);
+	page_data[14] &= ~(0x8F);
+
+	format_space_display(&display, text);
+	if(!display.shown)
+		return 0;
+
+	// segment frame
+	set_bit(page_data, 4, 7, 1);
+
+	// segments
+	uint16_t segments_raw = 0x0000;
+	for(i = 0; i < display.segments_used; i++)
+		segments_raw |= 1 << (9 - i);
+	page_data[6] = segments_raw >> 2;
+	page_data[7] |= (segments_raw & 0x03) << 6;
+
+	// digits + decimal point
+	for(i = 0; i < 3; i++)
+		if(display.digits_shown & (0x04 >> i))
+			page_data[12 + i] |= 0x80 | display.digits[i];
+	if(display.dec_point)
+		set_bit(page_data, 11, 1, 1);
+
+	// TB/GB indicator
+	set_bit(page_data, 10, display.tb_mode ? 2 : 1, 1);
+
+	// FREE indicator
+	set_bit(page_data, 10, 4, 1);
+
+	return 0;
+}
+
+
+// only for pages about to be written, not for the trial encodings of --predict
+void probe_space_encoded(const uint8_t *data, const char *text) {
+#ifdef HAVE_SDT
+	struct space_display display;
+	decode_space_display(data, &display);
+	DTRACE_PROBE3(leetcmd, space__encoded, display.segments_used, text, display.tb_mode);
+#else
+	(void) data;
+	(void) text;
+#endif
+}
+
+
+int set_free_space(uint64_t space_free, uint64_t space_total, unsigned int kb_factor) {
+	uint8_t data[SPACE_PAGE_LEN];
+	uint8_t current[SPACE_PAGE_LEN];
+	char text[SPACE_TEXT_LEN];
+
+	if(read_space_page(data))
+		return 1;
+
+	// hysteresis against what the drive shows, so one-shot runs do not flap either
+	memcpy(current, data, sizeof(current));
+	if(encode_free_space(data, space_free, space_total, kb_factor, current, text))
+		return 1;
+	printf("Free space: %s\n", text);
+	probe_space_encoded(data, text);
+
+	return write_space_page(data) == 1;
+}
+
+
+void init_request(struct request *req) {
+	memset(req, 0x00, sizeof(*req));
+	req->disable_vcd = -1;
+	req->inverse = -1;
+}
+
+
+void merge_request(struct request *into, const struct request *req) {
+	if(req->disable_vcd != -1) {
+		into->disable_vcd = req->disable_vcd;
+		into->disable_vcd_transient = req->disable_vcd_transient;
+	}
+	if(req->inverse != -1) {
+		into->inverse = req->inverse;
+		into->inverse_transient = req->inverse_transient;
+	}
+	if(req->label_set) {
+		into->label_set = 1;
+		memcpy(into->label, req->label, LABEL_LEN_RAW);
+	}
+	if(req->free_space) {
+		into->free_space = 1;
+		into->bytes_free = req->bytes_free;
+		into->bytes_total = req->bytes_total;
+		into->kb_factor = req->kb_factor;
+	}
+	into->show_state |= req->show_state;
+	into->revert |= req->revert;
+}
+
+
+// only the pages to change or to show are touched
+unsigned int plan_operations(const struct request *req) {
+	unsigned int ops = 0;
+	if(req->revert)
+		ops |= OP_REVERT;
+	if(req->disable_vcd != -1 || req->show_state)
+		ops |= OP_DISABLE_VCD;
+	if(req->inverse != -1 || req->show_state)
+		ops |= OP_INVERSE;
+	if(req->label_set || req->show_state)
+		ops |= OP_LABEL;
+	if(req->free_space)
+		ops |= OP_FREE_SPACE;
+	return ops;
+}
+
+
+int apply_operation(const char *opt_device, const struct request *req, unsigned int op) {
+	switch(op) {
+	case OP_REVERT:
+		// undo transient flag changes
+		return revert_mode_page("Disable VCD", 0x20, 6, 2, 1) || revert_mode_page("Inverse Display", 0x21, 10, 8, 0);
+	case OP_DISABLE_VCD:
+		return handle_mode_page_flag_value(req->disable_vcd, !req->disable_vcd_transient, "Disable VCD", 0x20, 6, 2, 1);
+	case OP_INVERSE:
+		return handle_mode_page_flag_value(req->inverse, !req->inverse_transient, "Inverse Display", 0x21, 10, 8, 0);
+	case OP_LABEL:
+		return handle_label_value(req->label_set ? req->label : NULL);
+	case OP_FREE_SPACE:
+		if(opt_idle_window)
+			wait_for_idle(opt_device, opt_idle_window, opt_idle_max_defer);
+		return set_free_space(req->bytes_free, req->bytes_total, req->kb_factor);
+	default:
+		return 0;
+	}
+}
+
+
+int apply_request(const char *opt_device, const struct request *req) {
+	unsigned int ops = plan_operations(req);
+
+	while(ops) {
+		unsigned int op = ops & -ops;
+		if(apply_operation(opt_device, req, op))
+			return 1;
+		ops &= ~op;
+	}
+
+	return 0;
+}
+
+
+/*
+ * dry run
+ *
+ * Issues the reads of a run to find out which writes would actually change
+ * something, and prints the resulting command sequence with latencies
+ * estimated from the recorded history. Nothing is written.
+ */
+
+struct plan {
+	double total_us;
+	int writes;
+};
+
+
+void plan_command(struct plan *plan, uint8_t opcode, uint8_t page, const char *skip_reason) {
+	char command[32];
+	if(opcode == 0x12)
+		snprintf(command, sizeof(command), "%s", get_command_name(opcode));
+	else
+		snprintf(command, sizeof(command), "%s 0x%02X", get_command_name(opcode), page);
+
+	if(skip_reason) {
+		printf("  %-20s skipped (%s)\n", command, skip_reason);
+		return;
+	}
+
+	const char *source;
+	double latency_us = estimate_latency(opcode, page, &source);
+	printf("  %-20s %8.1f ms (%s)\n", command, latency_us / 1000.0, source);
+
+	plan->total_us += latency_us;
+	if(opcode == 0x15 || opcode == 0x1D)
+		plan->writes++;
+}
+
+
+int plan_mode_page_flag_value(struct plan *plan, int opt_flag, const char *name, uint8_t page, size_t result_len, size_t flag_offset, size_t flag_bit) {
+	uint8_t data[6 + result_len];
+
+	if(read_mode_page(name, page, 0, data, result_len))
+		return 1;
+	plan_command(plan, 0x1A, page, NULL);
+
+	if(opt_flag == -1)
+		plan_command(plan, 0x15, page, "unchanged");
+	else if(get_bit(data + 6, flag_offset, flag_bit) == opt_flag)
+		plan_command(plan, 0x15, page, "already set");
+	else
+		plan_command(plan, 0x15, page, NULL);
+
+	return 0;
+}
+
+
+int plan_revert_mode_page(struct plan *plan, const char *name, uint8_t page, size_t result_len) {
+	uint8_t data[6 + result_len];
+	int differs;
+
+	if(mode_page_differs_from_saved(name, page, data, result_len, &differs))
+		return 1;
+	plan_command(plan, 0x1A, page, NULL);
+	plan_command(plan, 0x1A, page, NULL);
+	plan_command(plan, 0x15, page, differs ? NULL : "saved value current");
+	return 0;
+}
+
+
+int plan_request(const char *opt_device, const struct request *req) {
+	struct plan plan;
+	memset(&plan, 0x00, sizeof(plan));
+
+	printf("Plan for %s:\n", opt_device);
+	plan_command(&plan, 0x12, 0x00, inquiry_skipped ? "identity cached" : NULL);
+
+	unsigned int ops = plan_operations(req);
+	if(ops & OP_REVERT) {
+		if(plan_revert_mode_page(&plan, "Disable VCD", 0x20, 6) || plan_revert_mode_page(&plan, "Inverse Display", 0x21, 10))
+			return 1;
+	}
+	if((ops & OP_DISABLE_VCD) && plan_mode_page_flag_value(&plan, req->disable_vcd, "Disable VCD", 0x20, 6, 2, 1))
+		return 1;
+	if((ops & OP_INVERSE) && plan_mode_page_flag_value(&plan, req->inverse, "Inverse Display", 0x21, 10, 8, 0))
+		return 1;
+
+	if(ops & OP_LABEL) {
+		uint8_t label_page[LABEL_PAGE_LEN];
+		if(read_label_page(label_page))
+			return 1;
+		plan_command(&plan, 0x1C, 0x87, NULL);
+		if(!req->label_set)
+			plan_command(&plan, 0x1D, 0x87, "unchanged");
+		else if(!memcmp(label_page + 12, req->label, LABEL_LEN_RAW))
+			plan_command(&plan, 0x1D, 0x87, "already set");
+		else
+			plan_command(&plan, 0x1D, 0x87, NULL);
+	}
+
+	// the free space page does not read back what was written
+	if(ops & OP_FREE_SPACE) {
+		uint8_t space_page[SPACE_PAGE_LEN];
+		if(read_space_page(space_page))
+			return 1;
+		plan_command(&plan, 0x1C, 0x86, NULL);
+		plan_command(&plan, 0x1D, 0x86, NULL);
+	}
+
+	printf("Estimated: %.1f ms, %d write(s)\n", plan.total_us / 1000.0, plan.writes);
+	return 0;
+}
+
+
+/*
+ * per-device locking
+ *
+ * Instances working on the same drive serialize on a lock file keyed by the
+ * drive's sysfs identity, so the sg and sd nodes of a drive share a lock.
+ * An instance finding the drive locked drops its request into the drive's
+ * spool directory instead. The lock holder applies all spooled requests
+ * merged with its own in the same session and leaves the result in a .done
+ * file for the submitter.
+ */
+
+uint64_t hash_string(const char *text) {
+	// FNV-1a
+	uint64_t hash = 0xCBF29CE484222325ULL;
+	while(*text) {
+		hash ^= (uint8_t) *text++;
+		hash *= 0x100000001B3ULL;
+	}
+	return hash;
+}
+
+
+int get_dev_identity(const char *type, dev_t dev, char *identity) {
+	char path[PATH_MAX];
+
+	// a partition has no device link of its own
+	snprintf(path, sizeof(path), "/sys/dev/%s/%u:%u/device", type, major(dev), minor(dev));
+	if(realpath(path, identity))
+		return 0;
+	snprintf(path, sizeof(path), "/sys/dev/%s/%u:%u/../device", type, major(dev), minor(dev));
+	if(realpath(path, identity))
+		return 0;
+
+	// virtual block devices (loop, dm, ...): the whole disk
+	snprintf(path, sizeof(path), "/sys/dev/%s/%u:%u/partition", type, major(dev), minor(dev));
+	int partition = !access(path, F_OK);
+	snprintf(path, sizeof(path), "/sys/dev/%s/%u:%u%s", type, major(dev), minor(dev), partition ? "/.." : "");
+	if(!strcmp(type, "block") && realpath(path, identity))
+		return 0;
+
+	return 1;
+}
+
+
+void get_drive_identity(const char *device, char *identity) {
+	struct stat st;
+
+	if(!stat(device, &st) && (S_ISBLK(st.st_mode) || S_ISCHR(st.st_mode))) {
+		if(!get_dev_identity(S_ISBLK(st.st_mode) ? "block" : "char", st.st_rdev, identity))
+			return;
+	}
+
+	if(!realpath(device, identity))
+		snprintf(identity, PATH_MAX, "%s", device);
+}
+
+
+uint64_t get_drive_key(const char *device) {
+	char identity[PATH_MAX];
+	get_drive_identity(device, identity);
+	if(opt_verbose)
+		printf("Drive identity: %s\n", identity);
+
+	return hash_string(identity);
+}
+
+
+// the SCSI target of a LUN, shared by the SES and the disk LUN behind one bridge
+uint64_t get_target_key(const char *identity) {
+	char target[PATH_MAX];
+	unsigned int host, channel, id, lun;
+	char end;
+
+	snprintf(target, sizeof(target), "%s", identity);
+	char *name = strrchr(target, '/');
+	if(name && sscanf(name + 1, "%u:%u:%u:%u%c", &host, &channel, &id, &lun, &end) == 4)
+		*name = 0x00;
+	return hash_string(target);
+}
+
+
+uint64_t get_drive_target_key(const char *device) {
+	char identity[PATH_MAX];
+	get_drive_identity(device, identity);
+	return get_target_key(identity);
+}
+
+
+void open_write_stats(const char *device) {
+	char path[PATH_MAX];
+	if(mkdir(STATE_DIR, 0755) && errno != EEXIST) {
+		perror("Error while creating state directory - not persisting write statistics");
+		load_write_stats("");
+		return;
+	}
+
+	snprintf(path, sizeof(path), "%s/%016llx.stats", STATE_DIR, (unsigned long long) get_drive_key(device));
+	load_write_stats(path);
+}
+
+
+void get_last_space_path(const char *path, char *cache_path) {
+	char real_path[PATH_MAX];
+	if(!realpath(path, real_path))
+		snprintf(real_path, sizeof(real_path), "%s", path);
+	snprintf(cache_path, PATH_MAX, "%s/space-%016llx", STATE_DIR, (unsigned long long) hash_string(real_path));
+}
+
+
+int load_last_space(const char *path, uint64_t *bytes_free, uint64_t *bytes_total) {
+	char cache_path[PATH_MAX];
+	get_last_space_path(path, cache_path);
+
+	FILE *f = fopen(cache_path, "r");
+	if(!f)
+		return 1;
+	unsigned long long value_free;
+	unsigned long long value_total;
+	int result = fscanf(f, "%llu %llu", &value_free, &value_total) != 2;
+	fclose(f);
+
+	*bytes_free = value_free;
+	*bytes_total = value_total;
+	return result;
+}
+
+
+void save_last_space(const char *path, uint64_t bytes_free, uint64_t bytes_total) {
+	char cache_path[PATH_MAX];
+	char tmp_path[PATH_MAX + 4];
+	if(mkdir(STATE_DIR, 0755) && errno != EEXIST)
+		return;
+	get_last_space_path(path, cache_path);
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", cache_path);
+
+	FILE *f = fopen(tmp_path, "w");
+	if(!f)
+		return;
+	fprintf(f, "%llu %llu\n", (unsigned long long) bytes_free, (unsigned long long) bytes_total);
+	if(fclose(f) || rename(tmp_path, cache_path))
+		unlink(tmp_path);
+}
+
+
+// result of the probe started at startup, or a fallback if it hangs
+int finish_space_request(struct space_probe *probe, uint64_t deadline_ms, const char *path, struct request *req) {
+	int result = wait_space_probe(probe, deadline_ms, &req->bytes_free, &req->bytes_total);
+	release_space_probe(probe);
+	if(result == 1)
+		return 1;
+
+	if(result != PROBE_TIMED_OUT) {
+		save_last_space(path, req->bytes_free, req->bytes_total);
+	} else if(!load_last_space(path, &req->bytes_free, &req->bytes_total)) {
+		printf("Using last known free space of %s\n", path);
+	} else {
+		printf("Clearing free space of %s\n", path);
+		req->bytes_total = 0;
+	}
+	return 0;
+}
+
+
+// 0: attribute read, trailing whitespace removed
+int read_sysfs_attr(const char *dir, const char *name, char *value, size_t len) {
+	char path[PATH_MAX + 64];
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	FILE *f = fopen(path, "r");
+	if(!f)
+		return 1;
+	size_t read_len = fread(value, 1, len - 1, f);
+	fclose(f);
+
+	value[read_len] = 0x00;
+	while(read_len && isspace((unsigned char) value[read_len - 1]))
+		value[--read_len] = 0x00;
+	return 0;
+}
+
+
+// the sysfs dir of the USB device the drive hangs off, if any
+int find_usb_device(const char *device, char *usb_dir) {
+	get_drive_identity(device, usb_dir);
+
+	char *slash;
+	while((slash = strrchr(usb_dir, '/')) && slash != usb_dir) {
+		char attr_path[PATH_MAX + 16];
+		snprintf(attr_path, sizeof(attr_path), "%s/idVendor", usb_dir);
+		if(!access(attr_path, F_OK))
+			return 0;
+		*slash = 0x00;
+	}
+
+	return 1;
+}
+
+
+int find_usb_bridge(const char *device, char *vendor, char *product) {
+	char usb_dir[PATH_MAX];
+	if(find_usb_device(device, usb_dir))
+		return 1;
+
+	return read_sysfs_attr(usb_dir, "idVendor", vendor, 5) || read_sysfs_attr(usb_dir, "idProduct", product, 5);
+}
+
+
+void open_latency_history(const char *device) {
+	char path[PATH_MAX];
+	if(mkdir(STATE_DIR, 0755) && errno != EEXIST) {
+		load_latency_history(&drive_latency, "");
+		load_latency_history(&bridge_latency, "");
+		return;
+	}
+
+	snprintf(path, sizeof(path), "%s/%016llx.latency", STATE_DIR, (unsigned long long) get_drive_key(device));
+	load_latency_history(&drive_latency, path);
+
+	// same bridge model, similar latencies
+	char vendor[5];
+	char product[5];
+	if(!find_usb_bridge(device, vendor, product)) {
+		snprintf(path, sizeof(path), "%s/bridge-%s-%s.latency", STATE_DIR, vendor, product);
+		load_latency_history(&bridge_latency, path);
+	} else {
+		load_latency_history(&bridge_latency, "");
+	}
+}
+
+
+void get_history_path(const char *device, char *path) {
+	snprintf(path, PATH_MAX, "%s/%016llx.history", STATE_DIR, (unsigned long long) get_drive_key(device));
+}
+
+
+// 1: no usable history file
+int map_history(const char *path, int write, struct history_file **file) {
+	int fd = open(path, (write ? O_RDWR | O_CREAT : O_RDONLY) | O_CLOEXEC, 0644);
+	if(fd < 0)
+		return 1;
+
+	struct stat st;
+	int result = fstat(fd, &st);
+	if(!result && (size_t) st.st_size != sizeof(**file))
+		result = !write || ftruncate(fd, sizeof(**file));
+	if(result) {
+		close(fd);
+		return 1;
+	}
+
+	struct history_file *map = mmap(NULL, sizeof(*map), write ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED)
+		return 1;
+
+	// new, or of another layout
+	if(memcmp(map->magic, HISTORY_MAGIC, sizeof(map->magic)) || map->entry_len != sizeof(struct history_entry) || map->entries != HISTORY_LEN) {
+		if(!write) {
+			munmap(map, sizeof(*map));
+			return 1;
+		}
+		memset(map, 0x00, sizeof(*map));
+		memcpy(map->magic, HISTORY_MAGIC, sizeof(map->magic));
+		map->entry_len = sizeof(struct history_entry);
+		map->entries = HISTORY_LEN;
+	}
+
+	*file = map;
+	return 0;
+}
+
+
+// 0: consistent copy of record seq
+int copy_history_entry(const struct history_file *file, uint64_t seq, struct history_entry *entry) {
+	const struct history_entry *slot = &file->ring[(seq - 1) % HISTORY_LEN];
+
+	// copy, then check the record was not overwritten meanwhile
+	if(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != seq * 2)
+		return 1;
+	memcpy(entry, slot, sizeof(*entry));
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq * 2;
+}
+
+
+void open_display_history(const char *device) {
+	char path[PATH_MAX];
+	uint64_t key = get_drive_key(device);
+
+	if(!history || key != history_key) {
+		if(history)
+			munmap(history, sizeof(*history));
+		history = NULL;
+		history_key = key;
+		get_history_path(device, path);
+		if((mkdir(STATE_DIR, 0755) && errno != EEXIST) || map_history(path, 1, &history)) {
+			perror("Error while opening display history - not recording");
+			return;
+		}
+	}
+
+	// the display as of the last record that reached it; other workers may have added some
+	memset(&display_shown, 0x00, sizeof(display_shown));
+	uint64_t head = __atomic_load_n(&history->head, __ATOMIC_ACQUIRE);
+	uint64_t seq;
+	for(seq = head; seq > 0 && seq + HISTORY_LEN > head; seq--) {
+		struct history_entry entry;
+		if(!copy_history_entry(history, seq, &entry) && (entry.outcome == HISTORY_WRITTEN || entry.outcome == HISTORY_UNCHANGED)) {
+			display_shown = entry;
+			break;
+		}
+	}
+}
+
+
+const char* get_history_outcome_name(uint8_t outcome) {
+	switch(outcome) {
+	case HISTORY_WRITTEN:
+		return "written";
+	case HISTORY_UNCHANGED:
+		return "unchanged";
+	case HISTORY_BUDGET:
+		return "skipped (budget)";
+	case HISTORY_INTERVAL:
+		return "skipped (interval)";
+	default:
+		return "failed";
+	}
+}
+
+
+void format_label(const uint8_t *label, char *text) {
+	int i;
+	char c;
+
+	for(i = 0; i < LABEL_LEN; i++) {
+		uint16_t value = (label[i * 2] << 8) | label[i * 2 + 1];
+		text[i] = '?';
+		for(c = LABEL_ASCII_CHARS_START; c <= LABEL_ASCII_CHARS_END; c++) {
+			if(LABEL_ASCII_CHARS[c - LABEL_ASCII_CHARS_START] == value) {
+				text[i] = c;
+				break;
+			}
+		}
+	}
+
+	// without trailing blanks
+	while(i > 0 && text[i - 1] == ' ')
+		i--;
+	text[i] = 0x00;
+}
+
+
+void print_history_entry(const struct history_entry *entry) {
+	char time_text[32];
+	char space_text[SPACE_TEXT_LEN];
+	char label_text[LABEL_LEN + 1];
+	time_t time = entry->time_ms / 1000;
+	struct space_display display;
+
+	strftime(time_text, sizeof(time_text), "%Y-%m-%d %H:%M:%S", localtime(&time));
+	printf("%s page 0x%02X %s", time_text, entry->page, get_history_outcome_name(entry->outcome));
+
+	// the display after the write, as far as known
+	const char *separator = ":";
+	if(entry->known & HISTORY_KNOWN_SPACE) {
+		decode_space_display(entry->space_page, &display);
+		format_space_display(&display, space_text);
+		printf("%s free space %s", separator, space_text);
+		separator = ",";
+	}
+	if(entry->known & HISTORY_KNOWN_LABEL) {
+		format_label(entry->label, label_text);
+		printf("%s label \"%s\"", separator, label_text);
+		separator = ",";
+	}
+	if(entry->known & HISTORY_KNOWN_DISABLE_VCD) {
+		printf("%s disable VCD %d", separator, entry->flags & 0x01);
+		separator = ",";
+	}
+	if(entry->known & HISTORY_KNOWN_INVERSE)
+		printf("%s inverse %d", separator, (entry->flags >> 1) & 0x01);
+	printf("\n");
+
+	if(opt_verbose) {
+		if(entry->known & HISTORY_KNOWN_SPACE) {
+			printf("    space:");
+			dump_data(entry->space_page, SPACE_PAGE_LEN);
+		}
+		if(entry->known & HISTORY_KNOWN_LABEL) {
+			printf("    label:");
+			dump_data(entry->label, LABEL_LEN_RAW);
+		}
+	}
+}
+
+
+// from the history file only, the drive is not touched
+int print_display_history(const char *device) {
+	char path[PATH_MAX];
+	struct history_file *file;
+
+	get_history_path(device, path);
+	if(map_history(path, 0, &file)) {
+		fprintf(stderr, "No display history of %s\n", device);
+		return 1;
+	}
+
+	uint64_t head = __atomic_load_n(&file->head, __ATOMIC_ACQUIRE);
+	uint64_t first = head > HISTORY_LEN ? head - HISTORY_LEN : 0;
+	uint64_t outcomes[HISTORY_FAILED + 1];
+	uint64_t seq;
+	memset(outcomes, 0x00, sizeof(outcomes));
+
+	for(seq = first + 1; seq <= head; seq++) {
+		struct history_entry entry;
+		if(copy_history_entry(file, seq, &entry))
+			continue;
+		print_history_entry(&entry);
+		outcomes[entry.outcome <= HISTORY_FAILED ? entry.outcome : HISTORY_FAILED]++;
+	}
+
+	printf("%llu records, last %llu kept: %llu written, %llu unchanged, %llu skipped, %llu failed\n",
+			(unsigned long long) head, (unsigned long long) (head - first),
+			(unsigned long long) outcomes[HISTORY_WRITTEN],
+			(unsigned long long) outcomes[HISTORY_UNCHANGED],
+			(unsigned long long) (outcomes[HISTORY_BUDGET] + outcomes[HISTORY_INTERVAL]),
+			(unsigned long long) outcomes[HISTORY_FAILED]);
+
+	munmap(file, sizeof(*file));
+	return 0;
+}
+
+
+/*
+ * device identity cache
+ *
+ * The model check needs no INQUIRY for a drive that was verified before and
+ * has not been re-enumerated since: the kernel caches vendor, model and
+ * revision in sysfs, and a new USB device number or serial gives away a
+ * reconnect or swap. Only supported models are cached, so forced runs on
+ * other devices keep asking the drive.
+ */
+
+// 0: fingerprint of the drive's identity as far as the kernel knows it
+int get_device_fingerprint(const char *device, uint64_t *fingerprint) {
+	char identity[PATH_MAX];
+	char usb_dir[PATH_MAX];
+	char text[PATH_MAX + 512];
+	char vendor[64] = "";
+	char model[64] = "";
+	char revision[64] = "";
+	char devnum[16] = "";
+	char serial[128] = "";
+
+	get_drive_identity(device, identity);
+	int attrs = !read_sysfs_attr(identity, "vendor", vendor, sizeof(vendor));
+	attrs += !read_sysfs_attr(identity, "model", model, sizeof(model));
+	attrs += !read_sysfs_attr(identity, "rev", revision, sizeof(revision));
+	if(!attrs)
+		return 1;
+
+	if(!find_usb_device(device, usb_dir)) {
+		read_sysfs_attr(usb_dir, "devnum", devnum, sizeof(devnum));
+		read_sysfs_attr(usb_dir, "serial", serial, sizeof(serial));
+	}
+
+	snprintf(text, sizeof(text), "%s|%s|%s|%s|%s|%s", identity, vendor, model, revision, devnum, serial);
+	*fingerprint = hash_string(text);
+	return 0;
+}
+
+
+void get_identity_path(const char *device, char *path) {
+	snprintf(path, PATH_MAX, "%s/%016llx.identity", STATE_DIR, (unsigned long long) get_drive_key(device));
+}
+
+
+int load_identity(const char *device, uint64_t fingerprint, struct device_info *info) {
+	char path[PATH_MAX];
+	char line[64];
+	get_identity_path(device, path);
+
+	FILE *f = fopen(path, "r");
+	if(!f)
+		return 1;
+
+	// fingerprint, then the INQUIRY strings, one per line
+	int result = 1;
+	if(fgets(line, sizeof(line), f) && strtoull(line, NULL, 16) == fingerprint) {
+		char *fields[] = {info->vendor, info->product, info->revision};
+		size_t sizes[] = {sizeof(info->vendor), sizeof(info->product), sizeof(info->revision)};
+		size_t i;
+		result = 0;
+		for(i = 0; i < 3 && !result; i++) {
+			if(!fgets(line, sizeof(line), f)) {
+				result = 1;
+				break;
+			}
+			line[strcspn(line, "\n")] = 0x00;
+			snprintf(fields[i], sizes[i], "%s", line);
+		}
+	}
+	fclose(f);
+
+	return result || !is_supported_model(info);
+}
+
+
+void save_identity(const char *device, uint64_t fingerprint, const struct device_info *info) {
+	char path[PATH_MAX];
+	char tmp_path[PATH_MAX + 4];
+	if(mkdir(STATE_DIR, 0755) && errno != EEXIST)
+		return;
+	get_identity_path(device, path);
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+	FILE *f = fopen(tmp_path, "w");
+	if(!f)
+		return;
+	fprintf(f, "%016llx\n%s\n%s\n%s\n", (unsigned long long) fingerprint, info->vendor, info->product, info->revision);
+	if(fclose(f) || rename(tmp_path, path))
+		unlink(tmp_path);
+}
+
+
+int verify_identity(const char *opt_device, int opt_force, int opt_reverify, int fingerprinted, uint64_t fingerprint) {
+	struct device_info info;
+
+	// a recorded trace must hold the INQUIRY its replay sends
+	if(fingerprinted && !opt_reverify && !record_file && !load_identity(opt_device, fingerprint, &info)) {
+		inquiry_skipped = 1;
+		return report_device(opt_device, opt_force, &info, 1);
+	}
+
+	if(inquire_device(&info))
+		return 1;
+	if(fingerprinted && is_supported_model(&info))
+		save_identity(opt_device, fingerprint, &info);
+	return report_device(opt_device, opt_force, &info, 0);
+}
+
+
+// check_device, answered from the cache where possible
+int verify_device(const char *opt_device, int opt_force, int opt_reverify) {
+	uint64_t fingerprint;
+	int fingerprinted = !get_device_fingerprint(opt_device, &fingerprint);
+
+	return verify_identity(opt_device, opt_force, opt_reverify, fingerprinted, fingerprint);
+}
+
+
+int filter_spooled(const struct dirent *entry) {
+	size_t len = strlen(entry->d_name);
+	return len > 4 && !strcmp(entry->d_name + len - 4, ".req");
+}
+
+
+int write_spool_file(const char *name, const char *suffix, const void *data, size_t len) {
+	char tmp_path[PATH_MAX + NAME_MAX + 8];
+	char path[PATH_MAX + NAME_MAX + 8];
+	snprintf(tmp_path, sizeof(tmp_path), "%s/%s.tmp", spool_dir, name);
+	snprintf(path, sizeof(path), "%s/%s%s", spool_dir, name, suffix);
+
+	int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if(fd < 0)
+		return 1;
+	int result = write(fd, data, len) != (ssize_t) len;
+	close(fd);
+
+	// publish atomically
+	if(result || rename(tmp_path, path)) {
+		unlink(tmp_path);
+		return 1;
+	}
+	return 0;
+}
+
+
+size_t collect_requests(struct request *merged, char ***names) {
+	struct dirent **entries;
+	int count = scandir(spool_dir, &entries, filter_spooled, alphasort);
+	if(count <= 0)
+		return 0;
+
+	*names = calloc(count, sizeof(char*));
+	size_t collected = 0;
+	int i;
+	for(i = 0; i < count; i++) {
+		char path[PATH_MAX + NAME_MAX + 8];
+		struct request req;
+		snprintf(path, sizeof(path), "%s/%s", spool_dir, entries[i]->d_name);
+
+		int fd = open(path, O_RDONLY);
+		if(fd >= 0) {
+			int valid = read(fd, &req, sizeof(req)) == sizeof(req);
+			close(fd);
+			if(valid && !unlink(path) && *names) {
+				merge_request(merged, &req);
+				entries[i]->d_name[strlen(entries[i]->d_name) - 4] = 0x00;
+				(*names)[collected++] = strdup(entries[i]->d_name);
+			}
+		}
+		free(entries[i]);
+	}
+	free(entries);
+
+	if(collected)
+		printf("Merged %zu request(s) of other instances\n", collected);
+	return collected;
+}
+
+
+void finish_requests(char **names, size_t count, int result) {
+	size_t i;
+	for(i = 0; i < count; i++) {
+		if(names[i] && write_spool_file(names[i], ".done", &result, sizeof(result)))
+			fprintf(stderr, "Error while reporting result of request %s\n", names[i]);
+		free(names[i]);
+	}
+	free(names);
+}
+
+
+// 1: drive busy, hand over the request
+int lock_drive(const char *device) {
+	char lock_path[PATH_MAX];
+
+	uint64_t key = get_drive_key(device);
+	snprintf(lock_path, sizeof(lock_path), "%s/leetcmd-%016llx.lock", LOCK_DIR, (unsigned long long) key);
+	snprintf(spool_dir, sizeof(spool_dir), "%s/leetcmd-%016llx.d", LOCK_DIR, (unsigned long long) key);
+	lock_fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if(lock_fd < 0 || (mkdir(spool_dir, 0700) && errno != EEXIST)) {
+		perror("Error while creating drive lock - continuing unlocked");
+		if(lock_fd >= 0)
+			close(lock_fd);
+		lock_fd = -1;
+		return 0;
+	}
+
+	return flock(lock_fd, LOCK_EX | LOCK_NB) ? 1 : 0;
+}
+
+
+// 1: no result (yet)
+int read_handed_over_result(const char *done_path, int *handed_over_result) {
+	int fd = open(done_path, O_RDONLY);
+	if(fd < 0)
+		return 1;
+	int result = read(fd, handed_over_result, sizeof(*handed_over_result)) != sizeof(*handed_over_result);
+	close(fd);
+	unlink(done_path);
+
+	if(result) {
+		fprintf(stderr, "Result of handed over request lost\n");
+		*handed_over_result = 1;
+	} else {
+		printf("Request applied by other instance%s\n", *handed_over_result ? " - with errors!" : "");
+	}
+	return 0;
+}
+
+
+// 1: applied by the lock holder (or given up), 0: we are the holder now
+int hand_over_request(const struct request *req, int *handed_over_result) {
+	struct timespec ts;
+	char name[64];
+	char req_path[PATH_MAX + NAME_MAX + 8];
+	char done_path[PATH_MAX + NAME_MAX + 8];
+	clock_gettime(CLOCK_REALTIME, &ts);
+	snprintf(name, sizeof(name), "%010lld%09ld-%d", (long long) ts.tv_sec, ts.tv_nsec, (int) getpid());
+	if(write_spool_file(name, ".req", req, sizeof(*req))) {
+		perror("Error while handing over request");
+		return 0;
+	}
+	printf("Drive busy - request handed over to running instance\n");
+	snprintf(req_path, sizeof(req_path), "%s/%s.req", spool_dir, name);
+	snprintf(done_path, sizeof(done_path), "%s/%s.done", spool_dir, name);
+
+	// a watching holder keeps the lock, so wait for the result instead
+	int notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if(notify_fd >= 0 && inotify_add_watch(notify_fd, spool_dir, IN_MOVED_TO) < 0) {
+		close(notify_fd);
+		notify_fd = -1;
+	}
+
+	uint64_t deadline_ms = get_time_ms() + HAND_OVER_TIMEOUT_MS;
+	int picked_up = 0;
+	int result = 1;
+	for(;;) {
+		if(!read_handed_over_result(done_path, handed_over_result))
+			break;
+
+		// the holder is gone
+		if(!flock(lock_fd, LOCK_EX | LOCK_NB)) {
+			// not picked up: we are the holder now
+			if(!unlink(req_path)) {
+				result = 0;
+				break;
+			}
+			// the result is reported before the lock is released
+			if(read_handed_over_result(done_path, handed_over_result)) {
+				fprintf(stderr, "Result of handed over request lost\n");
+				*handed_over_result = 1;
+			}
+			break;
+		}
+
+		// once picked up, the result follows
+		if(!picked_up && access(req_path, F_OK))
+			picked_up = 1;
+		if(!picked_up && get_time_ms() >= deadline_ms) {
+			if(!unlink(req_path)) {
+				fprintf(stderr, "Request not picked up by running instance within %d s - not applied\n", HAND_OVER_TIMEOUT_MS / 1000);
+				*handed_over_result = 1;
+				break;
+			}
+			picked_up = 1;
+		}
+
+		if(notify_fd >= 0) {
+			struct pollfd pfd = {notify_fd, POLLIN, 0};
+			uint8_t events[4096] __attribute__((aligned(8)));
+			if(poll(&pfd, 1, HAND_OVER_POLL_MS) > 0)
+				while(read(notify_fd, events, sizeof(events)) > 0)
+					;
+		} else {
+			sleep_ms(HAND_OVER_POLL_MS);
+		}
+	}
+
+	if(notify_fd >= 0)
+		close(notify_fd);
+	return result;
+}
+
+
+int run_requests(const char *opt_device, const struct request *req) {
+	struct request merged = *req;
+	char **names = NULL;
+	size_t count = 0;
+
+	if(lock_fd >= 0)
+		count = collect_requests(&merged, &names);
+
+	// until no more requests were spooled meanwhile
+	for(;;) {
+		int result = apply_request(opt_device, &merged);
+		if(count)
+			finish_requests(names, count, result);
+		if(result)
+			return 1;
+
+		if(lock_fd < 0)
+			return 0;
+		init_request(&merged);
+		names = NULL;
+		count = collect_requests(&merged, &names);
+		if(!count)
+			return 0;
+		printf("\n");
+	}
+}
+
+
+/*
+ * label templates
+ *
+ * Placeholders:
+ *   {host}      host name (up to the first dot)
+ *   {used}      used space of <path> in percent
+ *   {temp}      drive temperature in degrees Celsius
+ *   {time}      local time (HH:MM)
+ *   {cmd:...}   first line of the output of a shell command
+ *
+ * Characters that cannot be displayed are shown as spaces, the text is cut
+ * to the label length.
+ */
+
+void expand_placeholder(struct drive *drive, const char *name, size_t name_len, char *value, size_t len) {
+	snprintf(value, len, "--");
+
+	if(name_len == 4 && !strncmp(name, "host", 4)) {
+		if(!gethostname(value, len)) {
+			value[len - 1] = 0x00;
+			value[strcspn(value, ".")] = 0x00;
+		}
+	} else if(name_len == 4 && !strncmp(name, "used", 4)) {
+		uint64_t bytes_free;
+		uint64_t bytes_total;
+		if(drive->path && !get_space_timed(&drive->used_probe, drive->path, &bytes_free, &bytes_total) && bytes_total)
+			snprintf(value, len, "%d", (int) ((bytes_total - bytes_free) * 100 / bytes_total));
+	} else if(name_len == 4 && !strncmp(name, "temp", 4)) {
+		// hwmon of any LUN behind the same target, e.g. drivetemp
+		char identity[PATH_MAX];
+		char pattern[PATH_MAX + 64];
+		glob_t g;
+		get_drive_identity(drive->device, identity);
+		snprintf(pattern, sizeof(pattern), "%s/../*/hwmon/hwmon*/temp1_input", identity);
+		if(!glob(pattern, 0, NULL, &g)) {
+			FILE *f = fopen(g.gl_pathv[0], "r");
+			long millidegrees;
+			if(f && fscanf(f, "%ld", &millidegrees) == 1)
+				snprintf(value, len, "%ld", millidegrees / 1000);
+			if(f)
+				fclose(f);
+			globfree(&g);
+		}
+	} else if(name_len == 4 && !strncmp(name, "time", 4)) {
+		time_t now = time(NULL);
+		struct tm tm;
+		strftime(value, len, "%H:%M", localtime_r(&now, &tm));
+	} else if(name_len > 4 && !strncmp(name, "cmd:", 4)) {
+		char command[256];
+		snprintf(command, sizeof(command), "%.*s", (int) (name_len - 4), name + 4);
+		FILE *f = popen(command, "r");
+		if(f) {
+			if(fgets(value, len, f))
+				value[strcspn(value, "\n")] = 0x00;
+			pclose(f);
+		}
+	}
+}
+
+
+void expand_template(struct drive *drive, char *text) {
+	const char *t = drive->label_template;
+	size_t len = 0;
+
+	while(*t && len < LABEL_LEN) {
+		const char *end = *t == '{' ? strchr(t, '}') : NULL;
+		if(!end) {
+			text[len++] = *t++;
+			continue;
+		}
+
+		char value[64];
+		expand_placeholder(drive, t + 1, end - t - 1, value, sizeof(value));
+		len += snprintf(text + len, LABEL_LEN + 1 - len, "%s", value);
+		if(len > LABEL_LEN)
+			len = LABEL_LEN;
+		t = end + 1;
+	}
+	text[len] = 0x00;
+}
+
+
+void encode_label_template(struct drive *drive, char *text, uint8_t *label) {
+	expand_template(drive, text);
+
+	memset(label, 0x00, LABEL_LEN_RAW);
+	size_t i;
+	for(i = 0; text[i]; i++) {
+		int value = get_label_char(text[i]);
+		if(value == -1)
+			value = 0x0000;
+
+		label[i*2] = (value >> 8) & 0xFF;
+		label[i*2 + 1] = value & 0xFF;
+	}
+}
+
+
+/*
+ * fleet mode
+ *
+ * Applies a request to every drive listed in a file. Each drive's operations
+ * run strictly in order, one step at a time: lock, open and check, then every
+ * page to change. A drive is only ever held by one worker. Every worker keeps
+ * its drives in two lanes: steps asked for by the operator (flags, label) go
+ * before free space refreshes on all workers. An idle worker steals whole
+ * drives from the others. Drives are dealt out interleaved by USB bus, so all
+ * buses are busy from the start. A drive is only open and locked while a
+ * worker runs its steps and is closed again when it goes back to a lane, so
+ * at most one drive per worker holds descriptors. Its free space probe and
+ * label template are started by the worker that opens it first.
+ *
+ * The outcome of every drive is appended to a checkpoint file per fleet file,
+ * synced in batches, with a hash of the drive's path and template. A run
+ * with --resume skips the drives recorded as done by an earlier run of the
+ * same request with the same line, before touching them at all.
+ */
+
+enum fleet_lane {
+	LANE_OPERATOR,
+	LANE_ROUTINE,
+	LANE_COUNT
+};
+
+struct fleet_drive {
+	const char *device;
+	const char *path;						// NULL: no free space, "-": clear
+	const char *label_template;				// NULL: the one of the command line, if any
+	struct request req;
+	int opened;								// checked and planned; closed while queued
+	unsigned int ops;						// still to apply, lowest first
+	int fd;
+	int lock_fd;
+	char spool_dir[PATH_MAX];
+	char **names;							// spooled requests merged into req
+	size_t names_count;
+	struct space_probe *space_probe;
+	uint64_t space_deadline_ms;
+	uint64_t bus;							// 0: not on USB
+	size_t bus_rank;						// among the drives of its bus
+	int skipped;							// done in an earlier run
+	int done;
+	int result;
+	struct fleet_drive *next;				// in a lane
+};
+
+struct fleet_worker {
+	struct fleet *fleet;
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	struct fleet_drive *head[LANE_COUNT];
+	struct fleet_drive *tail[LANE_COUNT];
+};
+
+struct fleet {
+	struct fleet_drive *drives;
+	size_t drive_count;
+	struct fleet_worker *workers;
+	int worker_count;
+	int opt_force;
+	int opt_reverify;
+	int opt_lock;
+	const char *label_template;				// NULL: none on the command line
+	int checkpoint_fd;						// -1: none
+	size_t checkpoint_unsynced;
+	uint64_t checkpoint_synced_ms;
+	pthread_mutex_t mutex;					// idle workers wait here; guards the checkpoint
+	pthread_cond_t cond;
+	uint64_t generation;					// bumped whenever a drive is queued or done
+	size_t pending;							// drives not done
+};
+
+static volatile sig_atomic_t fleet_running = 1;
+
+
+void stop_fleet(int sig) {
+	(void) sig;
+	fleet_running = 0;
+}
+
+
+// the root hub the drive hangs off, 0 if none
+uint64_t get_usb_bus(const char *device) {
+	char usb_dir[PATH_MAX];
+	if(find_usb_device(device, usb_dir))
+		return 0;
+
+	char *bus = strstr(usb_dir, "/usb");
+	char *end = bus ? strchr(bus + 1, '/') : NULL;
+	if(end)
+		*end = 0x00;
+	return hash_string(usb_dir);
+}
+
+
+// "<device> [<path> [<label template>]]", the template being the rest of the line; 1: no drive
+int parse_fleet_line(char *line, char **device, char **path, char **label_template) {
+	char *fields[3] = {NULL, NULL, NULL};
+	int i;
+
+	line[strcspn(line, "#\n")] = 0x00;
+	for(i = 0; i < 3; i++) {
+		line += strspn(line, " \t");
+		if(!*line)
+			break;
+		fields[i] = line;
+		if(i == 2) {
+			line += strlen(line);
+			while(line[-1] == ' ' || line[-1] == '\t')
+				*--line = 0x00;
+			break;
+		}
+		line += strcspn(line, " \t");
+		if(*line)
+			*line++ = 0x00;
+	}
+
+	*device = fields[0];
+	*path = fields[1];
+	*label_template = fields[2];
+	return !fields[0];
+}
+
+
+// one drive per line, # starts a comment
+int load_fleet(struct fleet *fleet, const char *file) {
+	FILE *f = fopen(file, "r");
+	if(!f) {
+		perror("Error while opening fleet file");
+		return 1;
+	}
+
+	char line[2 * PATH_MAX];
+	while(fgets(line, sizeof(line), f)) {
+		char *device;
+		char *path;
+		char *label_template;
+		if(parse_fleet_line(line, &device, &path, &label_template))
+			continue;
+
+		struct fleet_drive *drives = realloc(fleet->drives, (fleet->drive_count + 1) * sizeof(*drives));
+		if(!drives) {
+			perror("Error while malloc");
+			fclose(f);
+			return 1;
+		}
+		fleet->drives = drives;
+		struct fleet_drive *drive = &fleet->drives[fleet->drive_count++];
+		memset(drive, 0x00, sizeof(*drive));
+		drive->device = strdup(device);
+		drive->path = path ? strdup(path) : NULL;
+		drive->label_template = label_template ? strdup(label_template) : NULL;
+		drive->fd = -1;
+		drive->lock_fd = -1;
+	}
+	fclose(f);
+
+	if(!fleet->drive_count) {
+		fprintf(stderr, "No drives in fleet file %s\n", file);
+		return 1;
+	}
+	return 0;
+}
+
+
+// same request for all, but with their own label and free space
+void prepare_fleet(struct fleet *fleet, const struct request *req, const char *label_template, unsigned int kb_factor) {
+	fleet->label_template = label_template;
+	size_t i;
+	for(i = 0; i < fleet->drive_count; i++) {
+		struct fleet_drive *drive = &fleet->drives[i];
+		if(drive->skipped)
+			continue;
+		drive->req = *req;
+
+		// the label is encoded by the worker that opens the drive
+		if(drive->label_template || label_template)
+			drive->req.label_set = 1;
+
+		if(drive->path) {
+			drive->req.show_state = 0;
+			drive->req.free_space = 1;
+			if(strcmp(drive->path, "-"))
+				drive->req.kb_factor = kb_factor;
+		}
+	}
+}
+
+
+uint64_t hash_request(const struct request *req, const char *label_template, unsigned int kb_factor) {
+	// FNV-1a, continued over the template
+	uint64_t hash = 0xCBF29CE484222325ULL;
+	const uint8_t *data = (const uint8_t*) req;
+	size_t i;
+	for(i = 0; i < sizeof(*req); i++) {
+		hash ^= data[i];
+		hash *= 0x100000001B3ULL;
+	}
+
+	char text[32];
+	snprintf(text, sizeof(text), "%u ", kb_factor);
+	return hash ^ hash_string(text) ^ (label_template ? hash_string(label_template) : 0);
+}
+
+
+// path and template of a fleet line, as given
+uint64_t hash_fleet_drive(const struct fleet_drive *drive) {
+	uint64_t hash = hash_string(drive->path ? drive->path : "");
+	return hash * 0x100000001B3ULL ^ hash_string(drive->label_template ? drive->label_template : "");
+}
+
+
+int open_checkpoint(struct fleet *fleet, const char *file, uint64_t request_hash, int resume) {
+	char real_path[PATH_MAX];
+	char path[PATH_MAX];
+	char header[64];
+
+	fleet->checkpoint_fd = -1;
+	if(mkdir(STATE_DIR, 0755) && errno != EEXIST) {
+		perror("Error while creating state directory - no checkpoint");
+		return resume;
+	}
+	if(!realpath(file, real_path))
+		snprintf(real_path, sizeof(real_path), "%s", file);
+	snprintf(path, sizeof(path), "%s/fleet-%016llx.checkpoint", STATE_DIR, (unsigned long long) hash_string(real_path));
+	snprintf(header, sizeof(header), "request %016llx\n", (unsigned long long) request_hash);
+
+	// drives recorded as done by a run of the same request
+	FILE *f = resume ? fopen(path, "r") : NULL;
+	if(resume && !f) {
+		printf("No checkpoint of %s - starting over\n", file);
+		resume = 0;
+	}
+	if(f) {
+		char line[PATH_MAX + 32];
+		if(!fgets(line, sizeof(line), f) || strcmp(line, header)) {
+			printf("Checkpoint of %s is for another request - starting over\n", file);
+			resume = 0;
+		}
+		size_t skipped = 0;
+		while(resume && fgets(line, sizeof(line), f)) {
+			// torn last record
+			size_t len = strlen(line);
+			if(!len || line[len - 1] != '\n')
+				break;
+			line[len - 1] = 0x00;
+			unsigned long long line_hash;
+			int device_offset = 0;
+			if(sscanf(line, "done %16llx %n", &line_hash, &device_offset) != 1 || !device_offset)
+				continue;
+
+			// a changed path or template is not done yet
+			size_t i;
+			for(i = 0; i < fleet->drive_count; i++) {
+				struct fleet_drive *drive = &fleet->drives[i];
+				if(!drive->skipped && !strcmp(drive->device, line + device_offset) && hash_fleet_drive(drive) == line_hash) {
+					drive->skipped = 1;
+					skipped++;
+				}
+			}
+		}
+		fclose(f);
+		if(resume)
+			printf("Resuming: %zu drive(s) done before\n", skipped);
+	}
+
+	fleet->checkpoint_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC | (resume ? 0 : O_TRUNC), 0644);
+	if(fleet->checkpoint_fd < 0) {
+		perror("Error while opening checkpoint");
+		return 0;
+	}
+	if(!resume && write(fleet->checkpoint_fd, header, strlen(header)) != (ssize_t) strlen(header)) {
+		perror("Error while writing checkpoint");
+		close(fleet->checkpoint_fd);
+		fleet->checkpoint_fd = -1;
+	}
+	fleet->checkpoint_synced_ms = get_time_ms();
+	return 0;
+}
+
+
+// with the fleet mutex held
+void sync_checkpoint(struct fleet *fleet) {
+	if(fleet->checkpoint_fd < 0 || !fleet->checkpoint_unsynced)
+		return;
+	if(fdatasync(fleet->checkpoint_fd))
+		perror("Error while syncing checkpoint");
+	fleet->checkpoint_unsynced = 0;
+	fleet->checkpoint_synced_ms = get_time_ms();
+}
+
+
+// with the fleet mutex held
+void record_checkpoint(struct fleet *fleet, const struct fleet_drive *drive) {
+	char record[PATH_MAX + 32];
+	if(fleet->checkpoint_fd < 0)
+		return;
+
+	// a single append, so records never interleave
+	int len = snprintf(record, sizeof(record), "%s %016llx %s\n", drive->result ? "failed" : "done",
+			(unsigned long long) hash_fleet_drive(drive), drive->device);
+	if(write(fleet->checkpoint_fd, record, len) != len)
+		perror("Error while writing checkpoint");
+
+	fleet->checkpoint_unsynced++;
+	if(fleet->checkpoint_unsynced >= CHECKPOINT_BATCH || get_time_ms() - fleet->checkpoint_synced_ms >= CHECKPOINT_SYNC_MS)
+		sync_checkpoint(fleet);
+}
+
+
+enum fleet_lane get_fleet_lane(const struct fleet_drive *drive) {
+	unsigned int ops = drive->opened ? drive->ops : plan_operations(&drive->req);
+	return (ops & -ops) == OP_FREE_SPACE ? LANE_ROUTINE : LANE_OPERATOR;
+}
+
+
+// done: the drive is done, with drive->result
+void notify_fleet(struct fleet *fleet, const struct fleet_drive *done) {
+	pthread_mutex_lock(&fleet->mutex);
+	fleet->generation++;
+	if(done) {
+		record_checkpoint(fleet, done);
+		fleet->pending--;
+	}
+	pthread_cond_broadcast(&fleet->cond);
+	pthread_mutex_unlock(&fleet->mutex);
+}
+
+
+void queue_fleet_drive(struct fleet_worker *worker, struct fleet_drive *drive) {
+	enum fleet_lane lane = get_fleet_lane(drive);
+
+	drive->next = NULL;
+	pthread_mutex_lock(&worker->mutex);
+	if(worker->tail[lane])
+		worker->tail[lane]->next = drive;
+	else
+		worker->head[lane] = drive;
+	worker->tail[lane] = drive;
+	pthread_mutex_unlock(&worker->mutex);
+
+	notify_fleet(worker->fleet, NULL);
+}
+
+
+struct fleet_drive* dequeue_fleet_drive(struct fleet_worker *worker, enum fleet_lane lane) {
+	pthread_mutex_lock(&worker->mutex);
+	struct fleet_drive *drive = worker->head[lane];
+	if(drive) {
+		worker->head[lane] = drive->next;
+		if(!worker->head[lane])
+			worker->tail[lane] = NULL;
+	}
+	pthread_mutex_unlock(&worker->mutex);
+	return drive;
+}
+
+
+// own drives first, then stolen ones; operator steps of any worker before routine ones
+struct fleet_drive* take_fleet_drive(struct fleet_worker *worker) {
+	struct fleet *fleet = worker->fleet;
+	int self = worker - fleet->workers;
+	int lane;
+	int i;
+
+	for(lane = 0; lane < LANE_COUNT; lane++) {
+		for(i = 0; i < fleet->worker_count; i++) {
+			struct fleet_drive *drive = dequeue_fleet_drive(&fleet->workers[(self + i) % fleet->worker_count], lane);
+			if(drive)
+				return drive;
+		}
+	}
+	return NULL;
+}
+
+
+// 1: no more operations for the drive
+int finish_fleet_operations(struct fleet_drive *drive) {
+	while(!drive->ops) {
+		if(drive->names_count)
+			finish_requests(drive->names, drive->names_count, drive->result);
+		drive->names = NULL;
+		drive->names_count = 0;
+		if(drive->result || drive->lock_fd < 0)
+			return 1;
+
+		// until no more requests were spooled meanwhile
+		init_request(&drive->req);
+		drive->names_count = collect_requests(&drive->req, &drive->names);
+		if(!drive->names_count)
+			return 1;
+		drive->ops = plan_operations(&drive->req);
+	}
+	return 0;
+}
+
+
+// free space probe and label, on the first open of the drive
+int start_fleet_drive(struct fleet *fleet, struct fleet_drive *drive) {
+	if(drive->path && strcmp(drive->path, "-")) {
+		drive->space_probe = start_space_probe(drive->path);
+		if(!drive->space_probe)
+			return 1;
+		drive->space_deadline_ms = get_time_ms() + opt_space_timeout;
+	}
+
+	if(drive->label_template || fleet->label_template) {
+		struct drive template_drive;
+		char text[LABEL_LEN + 1];
+		memset(&template_drive, 0x00, sizeof(template_drive));
+		template_drive.device = drive->device;
+		template_drive.path = drive->path && strcmp(drive->path, "-") ? drive->path : NULL;
+		template_drive.label_template = drive->label_template ? drive->label_template : fleet->label_template;
+		encode_label_template(&template_drive, text, drive->req.label);
+		if(template_drive.used_probe)
+			release_space_probe(template_drive.used_probe);
+	}
+	return 0;
+}
+
+
+// 1: drive done, spooled requests merged so far finished with result
+int end_fleet_drive(struct fleet_drive *drive, int result) {
+	drive->result = result;
+	drive->ops = 0;
+	return finish_fleet_operations(drive);
+}
+
+
+// 1: drive done
+int open_fleet_drive(struct fleet *fleet, struct fleet_drive *drive) {
+	if(!drive->opened && start_fleet_drive(fleet, drive))
+		return end_fleet_drive(drive, 1);
+
+	// serialize with other instances
+	if(fleet->opt_lock && lock_drive(drive->device)) {
+		int handed_over_result;
+		int result = 0;
+		if(drive->space_probe)
+			result = finish_space_request(drive->space_probe, drive->space_deadline_ms, drive->path, &drive->req);
+		drive->space_probe = NULL;
+		if(result || hand_over_request(&drive->req, &handed_over_result)) {
+			// not ours to collect spooled requests with
+			if(lock_fd >= 0)
+				close(lock_fd);
+			lock_fd = -1;
+			drive->lock_fd = -1;
+			return end_fleet_drive(drive, result ? 1 : handed_over_result);
+		}
+	}
+	drive->lock_fd = lock_fd;
+	snprintf(drive->spool_dir, sizeof(drive->spool_dir), "%s", spool_dir);
+
+	open_write_stats(drive->device);
+	open_display_history(drive->device);
+	open_latency_history(drive->device);
+
+	drive->fd = transport->open(drive->device, opt_verbose);
+	device_fd = drive->fd;
+	if(drive->fd < 0) {
+		fprintf(stderr, "Error while opening device %s: %s\n", drive->device, strerror(errno));
+		return end_fleet_drive(drive, 1);
+	}
+
+	// reopened after waiting in a lane
+	if(drive->opened)
+		return 0;
+
+	if(verify_device(drive->device, fleet->opt_force, fleet->opt_reverify))
+		return end_fleet_drive(drive, 1);
+
+	if(drive->lock_fd >= 0)
+		drive->names_count = collect_requests(&drive->req, &drive->names);
+	drive->ops = plan_operations(&drive->req);
+	drive->opened = 1;
+	return finish_fleet_operations(drive);
+}
+
+
+// 1: drive done
+int run_fleet_operation(struct fleet_drive *drive) {
+	unsigned int op = drive->ops & -drive->ops;
+
+	open_write_stats(drive->device);
+	open_display_history(drive->device);
+	open_latency_history(drive->device);
+
+	// free space is only needed now
+	if(op == OP_FREE_SPACE && drive->space_probe) {
+		drive->result = finish_space_request(drive->space_probe, drive->space_deadline_ms, drive->path, &drive->req);
+		drive->space_probe = NULL;
+	}
+	if(!drive->result)
+		drive->result = apply_operation(drive->device, &drive->req, op);
+
+	drive->ops &= ~op;
+	if(drive->result)
+		drive->ops = 0;
+	return finish_fleet_operations(drive);
+}
+
+
+// device and lock only; the drive keeps its probe and requests
+void close_fleet_device(struct fleet_drive *drive) {
+	if(drive->fd >= 0 && transport->close(drive->fd))
+		perror("Error while closing device");
+	if(drive->lock_fd >= 0)
+		close(drive->lock_fd);
+	drive->fd = -1;
+	drive->lock_fd = -1;
+}
+
+
+void close_fleet_drive(struct fleet_drive *drive) {
+	close_fleet_device(drive);
+	if(drive->space_probe)
+		release_space_probe(drive->space_probe);
+	drive->space_probe = NULL;
+}
+
+
+// 1: drive done
+int run_fleet_step(struct fleet *fleet, struct fleet_drive *drive) {
+	// the drive becomes this thread's device
+	device_fd = drive->fd;
+	device_name = drive->device;
+	lock_fd = drive->lock_fd;
+	snprintf(spool_dir, sizeof(spool_dir), "%s", drive->spool_dir);
+
+	int done = drive->fd >= 0 ? run_fleet_operation(drive) : open_fleet_drive(fleet, drive);
+	save_latency_histories();
+	if(done)
+		close_fleet_drive(drive);
+
+	device_fd = -1;
+	lock_fd = -1;
+	return done;
+}
+
+
+void* run_fleet_worker(void *arg) {
+	struct fleet_worker *worker = arg;
+	struct fleet *fleet = worker->fleet;
+
+	for(;;) {
+		pthread_mutex_lock(&fleet->mutex);
+		uint64_t generation = fleet->generation;
+		size_t pending = fleet->pending;
+		pthread_mutex_unlock(&fleet->mutex);
+		if(!pending || !fleet_running)
+			break;
+		if(trace_dump_requested && worker == fleet->workers) {
+			trace_dump_requested = 0;
+			dump_trace();
+		}
+
+		struct fleet_drive *drive = take_fleet_drive(worker);
+		if(!drive) {
+			// drives held by other workers may come back
+			pthread_mutex_lock(&fleet->mutex);
+			while(fleet->generation == generation && fleet->pending && fleet_running)
+				pthread_cond_wait(&fleet->cond, &fleet->mutex);
+			pthread_mutex_unlock(&fleet->mutex);
+			continue;
+		}
+
+		// the drive's next steps of the same lane right away, so drives get done one by one
+		enum fleet_lane lane = get_fleet_lane(drive);
+		do {
+			drive->done = run_fleet_step(fleet, drive);
+		} while(!drive->done && fleet_running && get_fleet_lane(drive) == lane);
+		if(drive->done) {
+			notify_fleet(fleet, drive);
+		} else {
+			// a queued drive holds no descriptors; it is reopened when taken
+			close_fleet_device(drive);
+			queue_fleet_drive(worker, drive);
+		}
+		fflush(stdout);
+	}
+
+	return NULL;
+}
+
+
+int compare_fleet_bus(const void *a, const void *b) {
+	const struct fleet_drive *x = *(const struct fleet_drive* const*) a;
+	const struct fleet_drive *y = *(const struct fleet_drive* const*) b;
+	if(x->bus != y->bus)
+		return x->bus < y->bus ? -1 : 1;
+	return x < y ? -1 : (x > y);
+}
+
+
+int compare_fleet_rank(const void *a, const void *b) {
+	const struct fleet_drive *x = *(const struct fleet_drive* const*) a;
+	const struct fleet_drive *y = *(const struct fleet_drive* const*) b;
+	if(x->bus_rank != y->bus_rank)
+		return x->bus_rank < y->bus_rank ? -1 : 1;
+	return compare_fleet_bus(a, b);
+}
+
+
+int run_fleet(struct fleet *fleet, int workers) {
+	size_t i;
+
+	if(workers <= 0)
+		workers = sysconf(_SC_NPROCESSORS_ONLN);
+	if(workers > FLEET_WORKERS_MAX)
+		workers = FLEET_WORKERS_MAX;
+	// only what is left
+	size_t count = 0;
+	for(i = 0; i < fleet->drive_count; i++)
+		count += !fleet->drives[i].skipped;
+	if((size_t) workers > count)
+		workers = count;
+	if(workers < 1)
+		workers = 1;
+
+	fleet->workers = calloc(workers, sizeof(*fleet->workers));
+	struct fleet_drive **order = calloc(fleet->drive_count, sizeof(*order));
+	if(!fleet->workers || !order) {
+		perror("Error while malloc");
+		return 1;
+	}
+	fleet->worker_count = workers;
+	fleet->pending = count;
+	pthread_mutex_init(&fleet->mutex, NULL);
+	pthread_cond_init(&fleet->cond, NULL);
+	for(i = 0; i < (size_t) workers; i++) {
+		fleet->workers[i].fleet = fleet;
+		pthread_mutex_init(&fleet->workers[i].mutex, NULL);
+	}
+
+	// first drive of every bus, then the second one, ...
+	size_t j = 0;
+	for(i = 0; i < fleet->drive_count; i++) {
+		if(fleet->drives[i].skipped)
+			continue;
+		fleet->drives[i].bus = get_usb_bus(fleet->drives[i].device);
+		order[j++] = &fleet->drives[i];
+	}
+	qsort(order, count, sizeof(*order), compare_fleet_bus);
+	for(i = 1; i < count; i++)
+		order[i]->bus_rank = order[i]->bus == order[i - 1]->bus ? order[i - 1]->bus_rank + 1 : 0;
+	qsort(order, count, sizeof(*order), compare_fleet_rank);
+	for(i = 0; i < count; i++)
+		queue_fleet_drive(&fleet->workers[i % workers], order[i]);
+	free(order);
+
+	printf("Fleet: %zu drive(s), %d worker(s)\n\n", count, workers);
+	fflush(stdout);
+
+	// finish the steps under way, then leave the rest to --resume
+	struct sigaction sa;
+	memset(&sa, 0x00, sizeof(sa));
+	sa.sa_handler = stop_fleet;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	// this thread is worker 0; drives of workers that failed to start are stolen
+	for(i = 1; i < (size_t) workers; i++) {
+		if(pthread_create(&fleet->workers[i].thread, NULL, run_fleet_worker, &fleet->workers[i])) {
+			perror("Error while pthread_create");
+			fleet->workers[i].fleet = NULL;		// nothing to join
+		}
+	}
+	run_fleet_worker(&fleet->workers[0]);
+	for(i = 1; i < (size_t) workers; i++)
+		if(fleet->workers[i].fleet)
+			pthread_join(fleet->workers[i].thread, NULL);
+
+	pthread_mutex_lock(&fleet->mutex);
+	sync_checkpoint(fleet);
+	pthread_mutex_unlock(&fleet->mutex);
+	if(fleet->checkpoint_fd >= 0)
+		close(fleet->checkpoint_fd);
+
+	size_t failed = 0;
+	size_t left = 0;
+	for(i = 0; i < fleet->drive_count; i++) {
+		struct fleet_drive *drive = &fleet->drives[i];
+		if(drive->skipped)
+			continue;
+		if(!drive->done) {
+			// interrupted: spooled requests were not applied
+			if(drive->names_count)
+				finish_requests(drive->names, drive->names_count, 1);
+			close_fleet_drive(drive);
+			left++;
+			continue;
+		}
+		if(!drive->result)
+			continue;
+		if(!failed++)
+			fprintf(stderr, "\nFailed drives:\n");
+		fprintf(stderr, "%s\n", drive->device);
+	}
+
+	if(left) {
+		printf("\nFleet interrupted: %zu of %zu drive(s) left, %zu failed - continue with --resume\n", left, count, failed);
+		return 1;
+	}
+	printf("\nFleet done: %zu of %zu drive(s) failed\n", failed, count);
+	return failed != 0;
+}
+
+
+/*
+ * watch mode
+ */
+
+static volatile sig_atomic_t watch_running = 1;
+
+void stop_watch(int sig) {
+	(void) sig;
+	watch_running = 0;
+}
+
+
+// 1: commands may be issued to the drive
+int breaker_allows(const struct breaker *breaker, uint64_t now) {
+	return !breaker->open_until_ms || now >= breaker->open_until_ms;
+}
+
+
+void breaker_record(struct breaker *breaker, const char *device, int failed, uint64_t now) {
+	if(!failed) {
+		if(breaker->open_until_ms)
+			printf("Drive %s responding again\n", device);
+		memset(breaker, 0x00, sizeof(*breaker));
+		return;
+	}
+
+	breaker->failures++;
+	if(breaker->open_until_ms) {
+		// failed probe after the cool-down
+		breaker->cooldown_ms *= 2;
+		if(breaker->cooldown_ms > BREAKER_COOLDOWN_MAX_MS)
+			breaker->cooldown_ms = BREAKER_COOLDOWN_MAX_MS;
+	} else if(breaker->failures >= BREAKER_THRESHOLD) {
+		breaker->cooldown_ms = BREAKER_COOLDOWN_MIN_MS;
+	} else {
+		return;
+	}
+
+	breaker->open_until_ms = now + breaker->cooldown_ms;
+	fprintf(stderr, "Drive %s keeps failing - leaving it alone for %llu s\n", device, (unsigned long long) breaker->cooldown_ms / 1000);
+}
+
+
+int update_label(struct drive *drive) {
+	char text[LABEL_LEN + 1];
+	uint8_t data[LABEL_PAGE_LEN];
+	uint8_t *label_data = data + 4 + 8;
+
+	memcpy(data, drive->label_page, sizeof(data));
+	encode_label_template(drive, text, label_data);
+
+	// only write on change, and not too often
+	if(!memcmp(data, drive->label_page, sizeof(data))) {
+		DTRACE_PROBE1(leetcmd, label__skip, "unchanged");
+		return 0;
+	}
+	uint64_t now = get_time_ms();
+	if(drive->label_written_ms && now - drive->label_written_ms < (uint64_t) drive->label_interval * 1000) {
+		DTRACE_PROBE1(leetcmd, label__skip, "interval");
+		record_display(0x87, data, HISTORY_INTERVAL);
+		if(opt_verbose)
+			printf("Label \"%s\" deferred\n", text);
+		return 0;
+	}
+
+	printf("Label: \"%s\"\n", text);
+	int result = write_label_page(data);
+	if(result)
+		return result == 1;
+	memcpy(drive->label_page, data, sizeof(data));
+	drive->label_written_ms = now;
+
+	return 0;
+}
+
+
+/*
+ * predictive free space sampling
+ *
+ * The display only changes when a bar segment, a digit or the unit flips.
+ * From the fill rate of the file system the time until the encoded page
+ * would next change is predicted, and the next sample is taken just
+ * before it instead of every watch interval.
+ */
+
+void update_fill_rate(struct drive *drive, uint64_t bytes_free, uint64_t now) {
+	if(drive->space_sample_ms && now > drive->space_sample_ms) {
+		double rate = ((double) bytes_free - (double) drive->space_sample_free) * 1000.0 / (now - drive->space_sample_ms);
+
+		// smoothen
+		drive->fill_rate = drive->fill_rate_valid ? (drive->fill_rate + rate) / 2.0 : rate;
+		drive->fill_rate_valid = 1;
+	}
+	drive->space_sample_ms = now;
+	drive->space_sample_free = bytes_free;
+}
+
+
+int space_encoding_differs(const struct drive *drive, const uint8_t *current, uint64_t bytes_free, uint64_t bytes_total) {
+	uint8_t data[SPACE_PAGE_LEN];
+	char text[SPACE_TEXT_LEN];
+
+	memcpy(data, drive->space_page, sizeof(data));
+	if(encode_free_space(data, bytes_free, bytes_total, drive->kb_factor, drive->space_written_valid ? drive->space_written : NULL, text))
+		return 1;
+	return memcmp(data, current, sizeof(data)) != 0;
+}
+
+
+// ms until the displayed free space changes at the current fill rate; -1: never
+int64_t predict_space_change(const struct drive *drive, const uint8_t *current, uint64_t bytes_free, uint64_t bytes_total) {
+	if(!drive->fill_rate_valid || drive->fill_rate == 0.0)
+		return -1;
+
+	// bisect the smallest change of free space that changes the encoding
+	int filling = drive->fill_rate < 0.0;
+	uint64_t same = 0;
+	uint64_t differs = filling ? bytes_free : bytes_total - bytes_free;
+	if(!space_encoding_differs(drive, current, filling ? bytes_free - differs : bytes_free + differs, bytes_total))
+		return -1;
+
+	while(differs - same > 1) {
+		uint64_t delta = same + (differs - same) / 2;
+		if(space_encoding_differs(drive, current, filling ? bytes_free - delta : bytes_free + delta, bytes_total))
+			differs = delta;
+		else
+			same = delta;
+	}
+
+	double rate = filling ? -drive->fill_rate : drive->fill_rate;
+	return (int64_t) (differs / rate * 1000.0);
+}
+
+
+uint64_t next_space_sample(const struct drive *drive, const uint8_t *current, uint64_t bytes_free, uint64_t bytes_total, int interval) {
+	if(!opt_predict_max)
+		return (uint64_t) interval * 1000;
+
+	uint64_t min_ms = (uint64_t) opt_predict_min * 1000;
+	uint64_t max_ms = (uint64_t) opt_predict_max * 1000;
+
+	// a second sample is needed for the rate
+	if(!drive->fill_rate_valid)
+		return min_ms;
+
+	int64_t change_ms = predict_space_change(drive, current, bytes_free, bytes_total);
+	if(change_ms < 0)
+		return max_ms;
+
+	// just before, leaving room for a changing rate
+	uint64_t delay_ms = change_ms - change_ms / 10;
+	if(opt_verbose)
+		printf("Free space display changes in about %lld s\n", (long long) change_ms / 1000);
+
+	return delay_ms < min_ms ? min_ms : (delay_ms > max_ms ? max_ms : delay_ms);
+}
+
+
+int update_space(struct drive *drive, int interval) {
+	uint64_t bytes_free;
+	uint64_t bytes_total;
+	uint8_t data[SPACE_PAGE_LEN];
+	char text[SPACE_TEXT_LEN];
+	uint64_t now = get_time_ms();
+
+	drive->space_next_ms = now + (uint64_t) interval * 1000;
+	if(drive->unmounted) {
+		bytes_free = 0;
+		bytes_total = 0;
+		drive->space_next_ms = UINT64_MAX;
+	} else {
+		int result = get_space_timed(&drive->space_probe, drive->path, &bytes_free, &bytes_total);
+		if(result == 1)
+			return 1;
+		if(result == PROBE_TIMED_OUT) {
+			// last known value, if any
+			bytes_free = drive->space_sample_free;
+			bytes_total = drive->space_sample_total;
+		} else {
+			update_fill_rate(drive, bytes_free, now);
+			drive->space_sample_total = bytes_total;
+		}
+	}
+
+	memcpy(data, drive->space_page, sizeof(data));
+	if(encode_free_space(data, bytes_free, bytes_total, drive->kb_factor, drive->space_written_valid ? drive->space_written : NULL, text))
+		return 1;
+	if(!drive->unmounted)
+		drive->space_next_ms = now + next_space_sample(drive, data, bytes_free, bytes_total, interval);
+
+	// only write on change
+	if(drive->space_written_valid && !memcmp(data, drive->space_written, sizeof(data)))
+		return 0;
+
+	printf("Free space: %s\n", text);
+	probe_space_encoded(data, text);
+	if(opt_idle_window)
+		wait_for_idle(drive->device, opt_idle_window, opt_idle_max_defer);
+	int result = write_space_page(data);
+	if(result)
+		return result == 1;
+	memcpy(drive->space_written, data, sizeof(data));
+	drive->space_written_valid = 1;
+
+	return 0;
+}
+
+
+int apply_spooled_requests(struct drive *drive) {
+	struct request merged;
+	char **names = NULL;
+
+	init_request(&merged);
+	size_t count = collect_requests(&merged, &names);
+	if(!count)
+		return 0;
+
+	int result = apply_request(drive->device, &merged);
+	finish_requests(names, count, result);
+
+	// the pages may have been changed
+	drive->space_written_valid = 0;
+	if(drive->label_template && read_label_page(drive->label_page))
+		return 1;
+
+	return result;
+}
+
+
+/*
+ * write-triggered free space sampling
+ *
+ * A filesystem-wide fanotify mark reports any write or deletion on the file
+ * system of <path>. Free space is only sampled after such activity; all
+ * events within the debounce time are coalesced into one sample, so idle
+ * file systems cause no wakeups at all.
+ */
+
+int open_fanotify(const char *path) {
+	// FAN_DELETE requires FID reporting
+	int fd = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_NONBLOCK | FAN_REPORT_FID, O_RDONLY);
+	if(fd < 0) {
+		perror("Error while fanotify_init - sampling free space periodically");
+		return -1;
+	}
+
+	if(fanotify_mark(fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, FAN_MODIFY | FAN_CLOSE_WRITE | FAN_DELETE, AT_FDCWD, path)) {
+		perror("Error while fanotify_mark - sampling free space periodically");
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+
+void drain_events(int fd) {
+	uint8_t buf[4096] __attribute__((aligned(8)));
+	while(read(fd, buf, sizeof(buf)) > 0)
+		;
+}
+
+
+/*
+ * mount table
+ *
+ * The kernel signals changes of /proc/self/mountinfo with POLLPRI. The table
+ * is then re-read and diffed against the known mounts by mount ID, so only
+ * new mounts get their drive resolved through sysfs, and only a change
+ * touching the watched drive or <path> re-evaluates its binding. If the file
+ * system of <path> is no longer on the drive, free space follows a mount
+ * that is.
+ */
+
+struct mount {
+	int id;
+	dev_t dev;
+	uint64_t drive_key;		// SCSI target, 0: not backed by a block device
+	char *point;
+};
+
+static struct mount *mounts = NULL;
+static size_t mount_count = 0;
+
+
+struct mount* find_mount(struct mount *list, size_t count, int id) {
+	size_t i;
+	for(i = 0; i < count; i++)
+		if(list[i].id == id)
+			return &list[i];
+	return NULL;
+}
+
+
+int mount_affects_drive(const struct drive *drive, const struct mount *mount) {
+	return mount->drive_key == drive->key || !strcmp(mount->point, drive->path);
+}
+
+
+// 1: the mounts of the drive changed
+int read_mounts(struct drive *drive) {
+	struct mount *list = NULL;
+	size_t count = 0;
+	int changed = 0;
+	char *line = NULL;
+	size_t line_len = 0;
+
+	rewind(drive->mountinfo);
+	while(getline(&line, &line_len, drive->mountinfo) > 0) {
+		int id;
+		unsigned int dev_major;
+		unsigned int dev_minor;
+		char point[PATH_MAX];
+		if(sscanf(line, "%d %*d %u:%u %*s %4095s", &id, &dev_major, &dev_minor, point) != 4)
+			continue;
+		unescape_mount_point(point);
+
+		struct mount *grown = realloc(list, (count + 1) * sizeof(*list));
+		if(!grown)
+			break;
+		list = grown;
+
+		struct mount *mount = &list[count];
+		struct mount *known = find_mount(mounts, mount_count, id);
+		if(known) {
+			// taken over, drive already resolved
+			*mount = *known;
+			known->point = NULL;
+		} else {
+			char identity[PATH_MAX];
+			mount->id = id;
+			mount->dev = makedev(dev_major, dev_minor);
+			mount->drive_key = get_dev_identity("block", mount->dev, identity) ? 0 : get_target_key(identity);
+			mount->point = strdup(point);
+			if(!mount->point)
+				break;
+			changed |= mount_affects_drive(drive, mount);
+		}
+		count++;
+	}
+	free(line);
+
+	// unmounted
+	size_t i;
+	for(i = 0; i < mount_count; i++) {
+		if(!mounts[i].point)
+			continue;
+		changed |= mount_affects_drive(drive, &mounts[i]);
+		free(mounts[i].point);
+	}
+
+	free(mounts);
+	mounts = list;
+	mount_count = count;
+	return changed;
+}
+
+
+// drive of the file system <path> is on, 0: unknown
+uint64_t get_path_drive_key(const char *path) {
+	struct stat st;
+	if(stat(path, &st))
+		return 0;
+
+	size_t i;
+	for(i = 0; i < mount_count; i++)
+		if(mounts[i].dev == st.st_dev)
+			return mounts[i].drive_key;
+	return 0;
+}
+
+
+void bind_path(struct drive *drive) {
+	const char *path = NULL;
+	if(get_path_drive_key(drive->path_arg) == drive->key) {
+		path = drive->path_arg;
+	} else {
+		size_t i;
+		for(i = 0; i < mount_count && !path; i++)
+			if(mounts[i].drive_key == drive->key)
+				path = mounts[i].point;
+	}
+
+	drive->unmounted = !path;
+	if(path) {
+		if(path != drive->path_arg) {
+			snprintf(drive->bound_path, sizeof(drive->bound_path), "%s", path);
+			path = drive->bound_path;
+		}
+		printf("Free space of: %s\n", path);
+		drive->path = path;
+	} else {
+		printf("No file system of the drive mounted - clearing free space\n");
+		drive->path = drive->path_arg;
+	}
+
+	// a different file system: new mark, new rate, sample right away
+	if(drive->fanotify_fd >= 0) {
+		close(drive->fanotify_fd);
+		drive->fanotify_fd = -1;
+	}
+	if(opt_fanotify_debounce && !drive->unmounted)
+		drive->fanotify_fd = open_fanotify(drive->path);
+	if(drive->space_probe) {
+		release_space_probe(drive->space_probe);
+		drive->space_probe = NULL;
+	}
+	if(drive->used_probe) {
+		release_space_probe(drive->used_probe);
+		drive->used_probe = NULL;
+	}
+	drive->fill_rate_valid = 0;
+	drive->space_sample_ms = 0;
+	drive->space_sample_total = 0;
+	drive->space_next_ms = get_time_ms();
+}
+
+
+void open_mountinfo(struct drive *drive) {
+	// superblock mode reads the device itself
+	struct stat st;
+	if(!stat(drive->path_arg, &st) && S_ISBLK(st.st_mode))
+		return;
+
+	drive->mountinfo = fopen("/proc/self/mountinfo", "re");
+	if(!drive->mountinfo) {
+		perror("Error while opening mount table - not following mounts");
+		return;
+	}
+	drive->key = get_drive_target_key(drive->device);
+	read_mounts(drive);
+
+	// a file system elsewhere was chosen on purpose
+	if(get_path_drive_key(drive->path_arg) != drive->key) {
+		printf("%s is not on the drive - not following mounts\n", drive->path_arg);
+		fclose(drive->mountinfo);
+		drive->mountinfo = NULL;
+		drive->key = 0;
+	}
+}
+
+
+void update_mounts(struct drive *drive) {
+	drive->mounts_changed = 0;
+	if(read_mounts(drive))
+		bind_path(drive);
+}
+
+
+// UINT64_MAX: disarmed
+int arm_timer(int timer_fd, uint64_t deadline_ms) {
+	struct itimerspec its;
+	memset(&its, 0x00, sizeof(its));
+	if(deadline_ms != UINT64_MAX) {
+		its.it_value.tv_sec = deadline_ms / 1000;
+		its.it_value.tv_nsec = (deadline_ms % 1000) * 1000000;
+		if(!its.it_value.tv_sec && !its.it_value.tv_nsec)
+			its.it_value.tv_nsec = 1;
+	}
+	if(timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL)) {
+		perror("Error while timerfd_settime");
+		return 1;
+	}
+	return 0;
+}
+
+
+void wait_for_events(struct drive *drive, int timer_fd, int spool_fd, uint64_t deadline_ms) {
+	if(arm_timer(timer_fd, deadline_ms))
+		return;
+
+	struct pollfd fds[4];
+	nfds_t count = 0;
+	fds[count].fd = timer_fd;
+	fds[count++].events = POLLIN;
+	if(spool_fd >= 0) {
+		fds[count].fd = spool_fd;
+		fds[count++].events = POLLIN;
+	}
+	if(drive->fanotify_fd >= 0) {
+		fds[count].fd = drive->fanotify_fd;
+		fds[count++].events = POLLIN;
+	}
+	if(drive->mountinfo) {
+		fds[count].fd = fileno(drive->mountinfo);
+		fds[count++].events = POLLPRI;
+	}
+
+	// interrupted by a signal to stop
+	if(poll(fds, count, -1) < 0) {
+		if(errno != EINTR)
+			perror("Error while poll");
+		return;
+	}
+
+	nfds_t i;
+	for(i = 0; i < count; i++) {
+		if(drive->mountinfo && fds[i].fd == fileno(drive->mountinfo)) {
+			if(fds[i].revents & (POLLPRI | POLLERR))
+				drive->mounts_changed = 1;
+			continue;
+		}
+		if(!(fds[i].revents & POLLIN))
+			continue;
+
+		if(fds[i].fd == timer_fd) {
+			uint64_t expirations;
+			if(read(timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+				perror("Error while reading timer");
+		} else {
+			drain_events(fds[i].fd);
+		}
+
+		// coalesce until the pending sample
+		if(fds[i].fd == drive->fanotify_fd && drive->space_next_ms == UINT64_MAX)
+			drive->space_next_ms = get_time_ms() + opt_fanotify_debounce;
+	}
+}
+
+
+int watch_drive(struct drive *drive, int interval) {
+	struct sigaction sa;
+	memset(&sa, 0x00, sizeof(sa));
+	sa.sa_handler = stop_watch;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	if(drive->label_template && read_label_page(drive->label_page))
+		return 1;
+	if(drive->path && read_space_page(drive->space_page))
+		return 1;
+
+	// get_time_ms() is based on CLOCK_MONOTONIC, too
+	int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	if(timer_fd < 0) {
+		perror("Error while timerfd_create");
+		return 1;
+	}
+
+	// requests handed over by other instances
+	int spool_fd = -1;
+	if(lock_fd >= 0) {
+		spool_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if(spool_fd >= 0 && inotify_add_watch(spool_fd, spool_dir, IN_MOVED_TO) < 0) {
+			close(spool_fd);
+			spool_fd = -1;
+		}
+	}
+
+	if(drive->path)
+		open_mountinfo(drive);
+	if(drive->path && opt_fanotify_debounce)
+		drive->fanotify_fd = open_fanotify(drive->path);
+
+	printf("Watching, updating every %d s%s...\n", interval,
+			drive->fanotify_fd >= 0 ? " (free space after writes)" : (opt_predict_max ? " (free space when due)" : ""));
+	uint64_t next_ms = get_time_ms();
+	drive->space_next_ms = next_ms;
+	while(watch_running) {
+		uint64_t now = get_time_ms();
+
+		// errors are reported, but do not end the watch
+		if(drive->mounts_changed)
+			update_mounts(drive);
+		if(trace_dump_requested) {
+			trace_dump_requested = 0;
+			dump_trace();
+		}
+		if(!breaker_allows(&drive->breaker, now)) {
+			wait_for_events(drive, timer_fd, spool_fd, drive->breaker.open_until_ms);
+			continue;
+		}
+
+		uint64_t failures = command_failures;
+		uint64_t issued = commands_issued;
+		if(lock_fd >= 0)
+			apply_spooled_requests(drive);
+		if(drive->label_template && now >= next_ms) {
+			update_label(drive);
+			next_ms = now + (uint64_t) interval * 1000;
+		}
+		if(drive->path && now >= drive->space_next_ms) {
+			update_space(drive, interval);
+			if(drive->fanotify_fd >= 0)
+				drive->space_next_ms = UINT64_MAX;
+		}
+		if(commands_issued != issued)
+			breaker_record(&drive->breaker, drive->device, command_failures != failures, get_time_ms());
+		fflush(stdout);
+
+		uint64_t deadline_ms = drive->label_template ? next_ms : UINT64_MAX;
+		if(drive->path && drive->space_next_ms < deadline_ms)
+			deadline_ms = drive->space_next_ms;
+		wait_for_events(drive, timer_fd, spool_fd, deadline_ms);
+	}
+
+	if(drive->fanotify_fd >= 0)
+		close(drive->fanotify_fd);
+	if(drive->mountinfo)
+		fclose(drive->mountinfo);
+	if(spool_fd >= 0)
+		close(spool_fd);
+	close(timer_fd);
+	return 0;
+}
+
+
+/*
+ * fleet watch
+ *
+ * With --fleet and -w, all drives of the fleet file are watched, each on its
+ * own schedule and with its own breaker. One thread schedules them and hands
+ * due drives to a pool of workers, so a hung bridge only holds up the worker
+ * talking to it; a drive is only ever held by one worker. The fleet file
+ * is reloaded on SIGHUP and whenever it is written or replaced. A reload
+ * waits for the whole pool to go idle: no more drives are handed out, and
+ * the drives the workers hold are finished first, so a hung drive delays
+ * it until its command times out. The new list is diffed against the
+ * watched drives by device: only added drives are opened and checked, and
+ * only removed ones are closed. A drive whose <path>
+ * or label template changed gets just that page refreshed. All other drives
+ * keep their handles, cached pages and schedules. Mounts are not followed.
+ */
+
+// the per-thread state of a drive, swapped in while talking to it
+struct drive_context {
+	int fd;
+	int lock_fd;
+	char spool_dir[PATH_MAX];
+	struct write_stats write_stats;
+	char write_stats_path[PATH_MAX];
+	struct latency_history drive_latency;
+	struct latency_history bridge_latency;
+	struct history_file *history;
+	uint64_t history_key;
+	struct history_entry display_shown;
+};
+
+struct watched_drive {
+	struct drive drive;
+	struct drive_context context;
+	char *device;
+	char *path;								// NULL: no free space, "-": clear
+	char *label_template;					// NULL: the one of the command line, if any
+	int opened;
+	int label_valid;						// label page read
+	int space_valid;						// free space page read
+	int clear_space;
+	int spool_wd;							// -1: spool directory not watched
+	int spooled;							// requests handed over meanwhile
+	uint64_t label_next_ms;
+	uint64_t open_next_ms;
+	int listed;								// still in the fleet file, while reloading
+	int busy;								// queued for or held by a worker
+	struct watched_drive *queue_next;
+	struct watched_drive *next;
+};
+
+struct fleet_watch {
+	const char *file;
+	const char *file_name;					// without directory, for inotify
+	const struct request *req;				// applied once a drive is opened
+	const char *label_template;
+	unsigned int kb_factor;
+	int label_interval;
+	int interval;
+	int opt_force;
+	int opt_reverify;
+	int opt_lock;
+	int inotify_fd;							// -1: reload on SIGHUP only
+	int file_wd;
+	struct watched_drive *drives;
+	int jobs;
+	pthread_t *workers;
+	int worker_count;
+	pthread_mutex_t mutex;					// guards the queue, busy and spooled
+	pthread_cond_t cond;
+	struct watched_drive *queue_head;
+	struct watched_drive *queue_tail;
+	size_t busy_count;
+	int stopping;
+	int wake_fd;							// eventfd: a worker is done with a drive
+};
+
+static volatile sig_atomic_t fleet_reload_requested = 0;
+
+
+void request_fleet_reload(int sig) {
+	(void) sig;
+	fleet_reload_requested = 1;
+}
+
+
+void enter_drive_context(const struct drive_context *context, const char *device) {
+	device_fd = context->fd;
+	device_name = device;
+	lock_fd = context->lock_fd;
+	snprintf(spool_dir, sizeof(spool_dir), "%s", context->spool_dir);
+	write_stats = context->write_stats;
+	snprintf(write_stats_path, sizeof(write_stats_path), "%s", context->write_stats_path);
+	drive_latency = context->drive_latency;
+	bridge_latency = context->bridge_latency;
+	history = context->history;
+	history_key = context->history_key;
+	display_shown = context->display_shown;
+}
+
+
+void leave_drive_context(struct drive_context *context) {
+	context->fd = device_fd;
+	context->lock_fd = lock_fd;
+	snprintf(context->spool_dir, sizeof(context->spool_dir), "%s", spool_dir);
+	context->write_stats = write_stats;
+	snprintf(context->write_stats_path, sizeof(context->write_stats_path), "%s", write_stats_path);
+	context->drive_latency = drive_latency;
+	context->bridge_latency = bridge_latency;
+	context->history = history;
+	context->history_key = history_key;
+	context->display_shown = display_shown;
+
+	device_fd = -1;
+	lock_fd = -1;
+	history = NULL;
+}
+
+
+int strings_differ(const char *a, const char *b) {
+	return a && b ? strcmp(a, b) != 0 : a != b;
+}
+
+
+void configure_watched_drive(const struct fleet_watch *watch, struct watched_drive *wd) {
+	struct drive *drive = &wd->drive;
+	drive->device = wd->device;
+	drive->path = wd->path && strcmp(wd->path, "-") ? wd->path : NULL;
+	drive->path_arg = drive->path;
+	drive->label_template = wd->label_template ? wd->label_template : watch->label_template;
+	drive->kb_factor = watch->kb_factor;
+	drive->label_interval = watch->label_interval;
+}
+
+
+void close_watched_drive(struct fleet_watch *watch, struct watched_drive *wd) {
+	enter_drive_context(&wd->context, wd->device);
+	save_latency_histories();
+	if(device_fd >= 0 && transport->close(device_fd))
+		perror("Error while closing device");
+	if(lock_fd >= 0)
+		close(lock_fd);
+	if(history)
+		munmap(history, sizeof(*history));
+	device_fd = -1;
+	lock_fd = -1;
+	history = NULL;
+	history_key = 0;
+	leave_drive_context(&wd->context);
+
+	if(wd->spool_wd >= 0)
+		inotify_rm_watch(watch->inotify_fd, wd->spool_wd);
+	if(wd->drive.space_probe)
+		release_space_probe(wd->drive.space_probe);
+	if(wd->drive.used_probe)
+		release_space_probe(wd->drive.used_probe);
+	wd->spool_wd = -1;
+	wd->drive.space_probe = NULL;
+	wd->drive.used_probe = NULL;
+	wd->opened = 0;
+}
+
+
+// 1: not opened, retried later
+int open_watched_drive(struct fleet_watch *watch, struct watched_drive *wd) {
+	int result = 1;
+	enter_drive_context(&wd->context, wd->device);
+
+	// serialize with other instances
+	if(watch->opt_lock && lock_drive(wd->device)) {
+		printf("Drive %s busy - retrying later\n", wd->device);
+		close(lock_fd);
+		lock_fd = -1;
+		leave_drive_context(&wd->context);
+		return 1;
+	}
+
+	open_write_stats(wd->device);
+	open_display_history(wd->device);
+	open_latency_history(wd->device);
+
+	device_fd = transport->open(wd->device, opt_verbose);
+	if(device_fd < 0) {
+		fprintf(stderr, "Error while opening device %s: %s\n", wd->device, strerror(errno));
+	} else if(!verify_device(wd->device, watch->opt_force, watch->opt_reverify)) {
+		// the request of the command line, and spooled ones
+		struct request req = *watch->req;
+		if(wd->path && !strcmp(wd->path, "-"))
+			req.free_space = 1;
+		result = run_requests(wd->device, &req);
+	}
+	leave_drive_context(&wd->context);
+
+	if(result) {
+		close_watched_drive(watch, wd);
+		return 1;
+	}
+
+	if(watch->inotify_fd >= 0 && wd->context.lock_fd >= 0) {
+		int spool_wd = inotify_add_watch(watch->inotify_fd, wd->context.spool_dir, IN_MOVED_TO);
+		pthread_mutex_lock(&watch->mutex);
+		wd->spool_wd = spool_wd;
+		pthread_mutex_unlock(&watch->mutex);
+	}
+	wd->opened = 1;
+	wd->label_valid = 0;
+	wd->space_valid = 0;
+	wd->clear_space = 0;
+	wd->spooled = 0;
+	wd->label_next_ms = 0;
+	wd->drive.space_written_valid = 0;
+	wd->drive.space_next_ms = 0;
+	return 0;
+}
+
+
+void update_watched_drive(struct fleet_watch *watch, struct watched_drive *wd) {
+	struct drive *drive = &wd->drive;
+	enter_drive_context(&wd->context, wd->device);
+
+	// errors are reported, but do not end the watch
+	uint64_t now = get_time_ms();
+	uint64_t failures = command_failures;
+	uint64_t issued = commands_issued;
+	pthread_mutex_lock(&watch->mutex);
+	int spooled = wd->spooled;
+	wd->spooled = 0;
+	pthread_mutex_unlock(&watch->mutex);
+	if(spooled) {
+		int result = apply_spooled_requests(drive);
+		wd->label_valid = drive->label_template && !result;
+	}
+	if(wd->clear_space) {
+		wd->clear_space = set_free_space(0, 0, drive->kb_factor);
+		drive->space_written_valid = 0;
+	}
+	if(drive->label_template && now >= wd->label_next_ms) {
+		if(!wd->label_valid)
+			wd->label_valid = !read_label_page(drive->label_page);
+		if(wd->label_valid)
+			update_label(drive);
+		wd->label_next_ms = now + (uint64_t) watch->interval * 1000;
+	}
+	if(drive->path && now >= drive->space_next_ms) {
+		if(!wd->space_valid)
+			wd->space_valid = !read_space_page(drive->space_page);
+		if(wd->space_valid)
+			update_space(drive, watch->interval);
+		else
+			drive->space_next_ms = now + (uint64_t) watch->interval * 1000;
+	}
+	if(commands_issued != issued)
+		breaker_record(&drive->breaker, wd->device, command_failures != failures, get_time_ms());
+
+	leave_drive_context(&wd->context);
+}
+
+
+uint64_t next_watched_update(const struct watched_drive *wd) {
+	const struct drive *drive = &wd->drive;
+	if(!wd->opened)
+		return wd->open_next_ms > drive->breaker.open_until_ms ? wd->open_next_ms : drive->breaker.open_until_ms;
+
+	uint64_t next_ms = drive->label_template ? wd->label_next_ms : UINT64_MAX;
+	if(drive->path && drive->space_next_ms < next_ms)
+		next_ms = drive->space_next_ms;
+	if(wd->spooled || wd->clear_space)
+		next_ms = 0;
+
+	// a cool-down past its end stays until the next cycle that sends commands
+	return drive->breaker.open_until_ms > next_ms ? drive->breaker.open_until_ms : next_ms;
+}
+
+
+// one cycle of a drive, on a worker
+void run_watched_drive(struct fleet_watch *watch, struct watched_drive *wd) {
+	uint64_t now = get_time_ms();
+	if(!wd->opened) {
+		int failed = open_watched_drive(watch, wd);
+		breaker_record(&wd->drive.breaker, wd->device, failed, get_time_ms());
+		wd->open_next_ms = now + (uint64_t) watch->interval * 1000;
+	}
+
+	pthread_mutex_lock(&watch->mutex);
+	int due = wd->opened && breaker_allows(&wd->drive.breaker, now) && now >= next_watched_update(wd);
+	pthread_mutex_unlock(&watch->mutex);
+	if(due)
+		update_watched_drive(watch, wd);
+}
+
+
+// with the watch mutex held
+void queue_watched_drive(struct fleet_watch *watch, struct watched_drive *wd) {
+	wd->busy = 1;
+	wd->queue_next = NULL;
+	if(watch->queue_tail)
+		watch->queue_tail->queue_next = wd;
+	else
+		watch->queue_head = wd;
+	watch->queue_tail = wd;
+	watch->busy_count++;
+	pthread_cond_broadcast(&watch->cond);
+}
+
+
+void* run_fleet_watch_worker(void *arg) {
+	struct fleet_watch *watch = arg;
+
+	pthread_mutex_lock(&watch->mutex);
+	for(;;) {
+		while(!watch->queue_head && !watch->stopping)
+			pthread_cond_wait(&watch->cond, &watch->mutex);
+		if(watch->stopping)
+			break;
+		struct watched_drive *wd = watch->queue_head;
+		watch->queue_head = wd->queue_next;
+		if(!watch->queue_head)
+			watch->queue_tail = NULL;
+		pthread_mutex_unlock(&watch->mutex);
+
+		run_watched_drive(watch, wd);
+		fflush(stdout);
+
+		// back to the scheduler
+		uint64_t one = 1;
+		pthread_mutex_lock(&watch->mutex);
+		wd->busy = 0;
+		watch->busy_count--;
+		pthread_cond_broadcast(&watch->cond);
+		if(write(watch->wake_fd, &one, sizeof(one)) != sizeof(one) && errno != EAGAIN)
+			perror("Error while waking the fleet watch");
+	}
+	pthread_mutex_unlock(&watch->mutex);
+
+	return NULL;
+}
+
+
+// 1: no worker started
+int start_fleet_watch_workers(struct fleet_watch *watch) {
+	int workers = watch->jobs > 0 ? watch->jobs : sysconf(_SC_NPROCESSORS_ONLN);
+	if(workers > FLEET_WORKERS_MAX)
+		workers = FLEET_WORKERS_MAX;
+	if(workers < 1)
+		workers = 1;
+
+	watch->workers = calloc(workers, sizeof(*watch->workers));
+	if(!watch->workers) {
+		perror("Error while malloc");
+		return 1;
+	}
+	while(watch->worker_count < workers) {
+		if(pthread_create(&watch->workers[watch->worker_count], NULL, run_fleet_watch_worker, watch)) {
+			perror("Error while pthread_create");
+			break;
+		}
+		watch->worker_count++;
+	}
+	return watch->worker_count == 0;
+}
+
+
+// workers finish the cycle under way, queued drives are dropped
+void stop_fleet_watch_workers(struct fleet_watch *watch) {
+	pthread_mutex_lock(&watch->mutex);
+	watch->stopping = 1;
+	pthread_cond_broadcast(&watch->cond);
+	pthread_mutex_unlock(&watch->mutex);
+
+	int i;
+	for(i = 0; i < watch->worker_count; i++)
+		pthread_join(watch->workers[i], NULL);
+	free(watch->workers);
+	watch->workers = NULL;
+	watch->worker_count = 0;
+}
+
+
+// only drives whose configuration changed are touched
+int reload_fleet_watch(struct fleet_watch *watch) {
+	struct fleet fleet;
+	memset(&fleet, 0x00, sizeof(fleet));
+	if(load_fleet(&fleet, watch->file))
+		return 1;
+
+	struct watched_drive *wd;
+	for(wd = watch->drives; wd; wd = wd->next)
+		wd->listed = 0;
+
+	size_t added = 0;
+	size_t changed = 0;
+	size_t unchanged = 0;
+	struct watched_drive **tail = &watch->drives;
+	while(*tail)
+		tail = &(*tail)->next;
+
+	size_t i;
+	for(i = 0; i < fleet.drive_count; i++) {
+		struct fleet_drive *listed = &fleet.drives[i];
+		for(wd = watch->drives; wd && strcmp(wd->device, listed->device); wd = wd->next)
+			;
+
+		if(wd && wd->listed) {
+			fprintf(stderr, "Drive %s listed twice in %s - ignoring the repetition\n", listed->device, watch->file);
+			continue;
+		}
+		if(!wd) {
+			wd = calloc(1, sizeof(*wd));
+			if(!wd) {
+				perror("Error while malloc");
+				break;
+			}
+			wd->device = (char*) listed->device;
+			wd->path = (char*) listed->path;
+			wd->label_template = (char*) listed->label_template;
+			listed->device = NULL;
+			listed->path = NULL;
+			listed->label_template = NULL;
+			wd->context.fd = -1;
+			wd->context.lock_fd = -1;
+			wd->spool_wd = -1;
+			wd->drive.fanotify_fd = -1;
+			configure_watched_drive(watch, wd);
+			wd->listed = 1;
+			*tail = wd;
+			tail = &wd->next;
+			added++;
+			continue;
+		}
+
+		wd->listed = 1;
+		int path_changed = strings_differ(wd->path, listed->path);
+		int template_changed = strings_differ(wd->label_template, listed->label_template);
+		if(!path_changed && !template_changed) {
+			unchanged++;
+			continue;
+		}
+		changed++;
+		printf("Drive %s changed\n", wd->device);
+
+		if(path_changed) {
+			free(wd->path);
+			wd->path = (char*) listed->path;
+			listed->path = NULL;
+		}
+		if(template_changed) {
+			free(wd->label_template);
+			wd->label_template = (char*) listed->label_template;
+			listed->label_template = NULL;
+		}
+		configure_watched_drive(watch, wd);
+
+		// refreshed with the next update
+		if(path_changed) {
+			struct drive *drive = &wd->drive;
+			if(drive->space_probe)
+				release_space_probe(drive->space_probe);
+			if(drive->used_probe)
+				release_space_probe(drive->used_probe);
+			drive->space_probe = NULL;
+			drive->used_probe = NULL;
+			drive->fill_rate_valid = 0;
+			drive->space_sample_ms = 0;
+			drive->space_sample_total = 0;
+			drive->space_next_ms = 0;
+			wd->clear_space = wd->opened && wd->path && !strcmp(wd->path, "-");
+		}
+		if(template_changed)
+			wd->label_next_ms = 0;
+	}
+
+	// no longer listed
+	size_t removed = 0;
+	struct watched_drive **link = &watch->drives;
+	while((wd = *link)) {
+		if(wd->listed) {
+			link = &wd->next;
+			continue;
+		}
+		*link = wd->next;
+		if(wd->opened)
+			close_watched_drive(watch, wd);
+		free(wd->device);
+		free(wd->path);
+		free(wd->label_template);
+		free(wd);
+		removed++;
+	}
+
+	for(i = 0; i < fleet.drive_count; i++) {
+		free((char*) fleet.drives[i].device);
+		free((char*) fleet.drives[i].path);
+		free((char*) fleet.drives[i].label_template);
+	}
+	free(fleet.drives);
+
+	printf("Fleet %s: %zu drive(s) added, %zu removed, %zu changed, %zu unchanged\n", watch->file, added, removed, changed, unchanged);
+	return 0;
+}
+
+
+void read_fleet_events(struct fleet_watch *watch) {
+	uint8_t buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t len;
+
+	while((len = read(watch->inotify_fd, buf, sizeof(buf))) > 0) {
+		ssize_t offset = 0;
+		while(offset < len) {
+			const struct inotify_event *event = (const struct inotify_event*) (buf + offset);
+			offset += sizeof(*event) + event->len;
+
+			if(event->wd == watch->file_wd) {
+				if(event->len && !strcmp(event->name, watch->file_name))
+					fleet_reload_requested = 1;
+				continue;
+			}
+			struct watched_drive *wd;
+			pthread_mutex_lock(&watch->mutex);
+			for(wd = watch->drives; wd; wd = wd->next)
+				if(wd->spool_wd == event->wd)
+					wd->spooled = 1;
+			pthread_mutex_unlock(&watch->mutex);
+		}
+	}
+}
+
+
+int watch_fleet(struct fleet_watch *watch) {
+	struct sigaction sa;
+	memset(&sa, 0x00, sizeof(sa));
+	sa.sa_handler = stop_watch;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sa.sa_handler = request_fleet_reload;
+	sigaction(SIGHUP, &sa, NULL);
+
+	int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	if(timer_fd < 0) {
+		perror("Error while timerfd_create");
+		return 1;
+	}
+
+	// the directory, as editors replace the file
+	char dir[PATH_MAX];
+	snprintf(dir, sizeof(dir), "%s", watch->file);
+	char *slash = strrchr(dir, '/');
+	watch->file_name = slash ? watch->file + (slash - dir) + 1 : watch->file;
+	if(!slash)
+		snprintf(dir, sizeof(dir), ".");
+	else if(slash == dir)
+		dir[1] = 0x00;
+	else
+		*slash = 0x00;
+	watch->file_wd = -1;
+	watch->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if(watch->inotify_fd >= 0)
+		watch->file_wd = inotify_add_watch(watch->inotify_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO);
+	if(watch->file_wd < 0)
+		perror("Error while watching fleet file - reloading on SIGHUP only");
+
+	pthread_mutex_init(&watch->mutex, NULL);
+	pthread_cond_init(&watch->cond, NULL);
+	watch->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(watch->wake_fd < 0) {
+		perror("Error while eventfd");
+		close(timer_fd);
+		return 1;
+	}
+	if(reload_fleet_watch(watch) || start_fleet_watch_workers(watch)) {
+		close(watch->wake_fd);
+		close(timer_fd);
+		return 1;
+	}
+	printf("Watching, updating every %d s on %d worker(s); reloading %s on change or SIGHUP...\n", watch->interval, watch->worker_count, watch->file);
+
+	struct watched_drive *wd;
+	while(watch_running) {
+		// the drives a worker holds are left alone until it is done with them
+		pthread_mutex_lock(&watch->mutex);
+		int idle = !watch->busy_count;
+		pthread_mutex_unlock(&watch->mutex);
+		if(fleet_reload_requested && idle) {
+			fleet_reload_requested = 0;
+			if(reload_fleet_watch(watch))
+				fprintf(stderr, "Keeping the drives as they are\n");
+		}
+		if(trace_dump_requested) {
+			trace_dump_requested = 0;
+			dump_trace();
+		}
+
+		// due drives to the workers, none while a reload waits; busy ones wake this thread when done
+		uint64_t deadline_ms = UINT64_MAX;
+		uint64_t now = get_time_ms();
+		pthread_mutex_lock(&watch->mutex);
+		for(wd = watch->drives; wd && !fleet_reload_requested; wd = wd->next) {
+			if(wd->busy)
+				continue;
+			uint64_t next_ms = next_watched_update(wd);
+			if(now >= next_ms)
+				queue_watched_drive(watch, wd);
+			else if(next_ms < deadline_ms)
+				deadline_ms = next_ms;
+		}
+		pthread_mutex_unlock(&watch->mutex);
+		fflush(stdout);
+
+		// interrupted by a signal to stop or reload
+		if(!watch_running || (fleet_reload_requested && idle) || arm_timer(timer_fd, deadline_ms))
+			continue;
+		struct pollfd fds[3];
+		nfds_t count = 0;
+		fds[count].fd = timer_fd;
+		fds[count++].events = POLLIN;
+		fds[count].fd = watch->wake_fd;
+		fds[count++].events = POLLIN;
+		if(watch->inotify_fd >= 0) {
+			fds[count].fd = watch->inotify_fd;
+			fds[count++].events = POLLIN;
+		}
+		if(poll(fds, count, -1) < 0) {
+			if(errno != EINTR)
+				perror("Error while poll");
+			continue;
+		}
+		if(fds[0].revents & POLLIN)
+			drain_events(timer_fd);
+		if(fds[1].revents & POLLIN)
+			drain_events(watch->wake_fd);
+		if(count > 2 && (fds[2].revents & POLLIN))
+			read_fleet_events(watch);
+	}
+
+	stop_fleet_watch_workers(watch);
+	while((wd = watch->drives)) {
+		watch->drives = wd->next;
+		if(wd->opened)
+			close_watched_drive(watch, wd);
+		free(wd->device);
+		free(wd->path);
+		free(wd->label_template);
+		free(wd);
+	}
+	if(watch->inotify_fd >= 0)
+		close(watch->inotify_fd);
+	close(watch->wake_fd);
+	close(timer_fd);
+	return 0;
+}
+
+
+void usage(const char* exe) {
+	printf("Controls the electronic ink display of WD My Book HDDs.\n");
 	printf("Note: This tool is not related in any way to WD.\n");
 	printf("\n");
 	printf("Usage: %s [OPTIONS] <device> [<path>]\n", exe);
+	printf("       %s [OPTIONS] --fleet <file>\n", exe);
 	printf("\n");
 	printf("  <device>      device path (e.g. /dev/sdh)\n");
-	printf("  <path>        file system path whose free space to display (\"-\" to clear)\n");
+	printf("  <path>        file system path whose free space to display (\"-\" to clear);\n");
+	printf("                for an unmounted block device (ext2/3/4, XFS, exFAT) the\n");
+	printf("                free space is read from its superblock, for a mounted one\n");
+	printf("                from its mount point; unmounted NTFS and other file systems\n");
+	printf("                are rejected\n");
 	printf("\n");
 	printf("  -v            verbose output\n");
 	printf("  -f            force mode (continue on unsupported model)\n");
+	printf("  --reverify    check the model with the drive, even if its identity is cached\n");
 	printf("  -k            compute with 1 kB = 1000 bytes (instead of 1024 bytes)\n");
+	printf("  --record <file>\n");
+	printf("                record all SCSI commands and responses to a trace file; the\n");
+	printf("                drive is asked for its model even if its identity is cached\n");
+	printf("  --replay <file>\n");
+	printf("                serve SCSI responses from a trace file instead of the device\n");
+	printf("  --realtime    replay with the recorded command latencies\n");
+	printf("  --dump-trace  print the commands issued at exit (implied by -v); also on\n");
+	printf("                SIGUSR1\n");
+	printf("  --write-budget <writes>[/<seconds>]\n");
+	printf("                allow at most <writes> page writes per <seconds> (default %d);\n", BUDGET_PERIOD_DEFAULT_S);
+	printf("                further writes are deferred (watch mode) or dropped\n");
+	printf("  --stats       print the write statistics of <device> and exit\n");
+	printf("  --history     print the pages written to or skipped on <device> with the\n");
+	printf("                resulting display, from the history kept in %s, and exit\n", STATE_DIR);
+	printf("  --plan        dry run: print the commands a run would issue, with estimated\n");
+	printf("                latencies; only reads are sent to the device\n");
+	printf("  --no-lock     do not serialize with other instances on the same drive\n");
+	printf("  --fleet <file>\n");
+	printf("                apply to every drive in <file>, one \"<device> [<path>\n");
+	printf("                [<template>]]\" per line, on a pool of workers; flag and label\n");
+	printf("                changes of all drives go before free space updates; with -w,\n");
+	printf("                watch them all and reload <file> on change or SIGHUP, touching\n");
+	printf("                only the drives whose line changed, once every worker is idle\n");
+	printf("  --jobs <n>    number of fleet workers, also with -w; without -w, at most\n");
+	printf("                <n> drives are open at a time (default: number of CPUs)\n");
+	printf("  --resume      skip the drives of <file> an interrupted run of the same\n");
+	printf("                request has already done\n");
+	printf("  --space-timeout <ms>\n");
+	printf("                give up on free space of a hanging <path> after <ms> (default\n");
+	printf("                %d) and show the last known value or clear it\n", SPACE_TIMEOUT_DEFAULT_MS);
+	printf("  --idle <ms>[,<max>]\n");
+	printf("                defer free space update until the drive was idle for <ms>\n");
+	printf("                (at most <max> ms, default %d); use idle I/O priority\n", IDLE_MAX_DEFER_DEFAULT_MS);
 	printf("\n");
 	printf("  -D/-d         set/unset VCD disabled flag\n");
 	printf("  -I/-i         set/unset inverse display flag\n");
+	printf("  --transient   change flags until the next power cycle only (not saved)\n");
+	printf("  --revert      restore the saved flags, undoing transient changes\n");
 	printf("  -l <text>     set label (text)\n");
 	printf("  -L <hex>      set label (raw hex)\n");
+	printf("  -t <template> set label from template; placeholders: {host} {used} {temp}\n");
+	printf("                {time} {cmd:<command>}\n");
+	printf("\n");
+	printf("  -w <seconds>  keep running, refreshing label template and free space\n");
+	printf("                every <seconds>; pages are only written on change; free space\n");
+	printf("                follows the drive's mounts if <path> leaves the drive\n");
+	printf("  --predict <min>,<max>\n");
+	printf("                sample free space only shortly before the display would change\n");
+	printf("                at the current fill rate, every <min> to <max> seconds\n");
+	printf("  --fanotify <ms>\n");
+	printf("                sample free space only after writes to its file system,\n");
+	printf("                coalescing all writes within <ms>\n");
+	printf("  --hysteresis <percent>\n");
+	printf("                only switch back from TB to GB, from integer to decimal format\n");
+	printf("                and to a bar segment once <percent> past the switch point\n");
+	printf("                (of the value resp. of capacity, default %d)\n", HYSTERESIS_DEFAULT_BP / 100);
+	printf("  --label-interval <seconds>\n");
+	printf("                minimum time between label writes (default %d)\n", LABEL_INTERVAL_DEFAULT_S);
 	printf("\n");
 	printf("Models supported so far:\n");
 
@@ -610,19 +5512,36 @@ void usage(const char* exe) {
 }
 
 
+#ifndef LEETCMD_NO_MAIN
 int main(int argc, char *argv[]) {
 	atexit(clean_up);
+	trace_epoch_us = get_time_us();
 
 	const char* opt_device = NULL;
 	const char* opt_path = NULL;
 
 	int opt_force = 0;
 	int opt_kb_factor = 0;
+	int opt_lock = 1;
+	int opt_stats = 0;
+	int opt_history = 0;
+	int opt_plan = 0;
+	int opt_transient = 0;
+	int opt_revert = 0;
+	int opt_reverify = 0;
+	const char* opt_fleet = NULL;
+	int opt_jobs = 0;
+	int opt_resume = 0;
+	const char* opt_record = NULL;
+	const char* opt_replay = NULL;
 
 	int opt_disable_vcd = -1;
 	int opt_inverse = -1;
 	const char* opt_label_text = NULL;
 	const char* opt_label_raw = NULL;
+	const char* opt_label_template = NULL;
+	int opt_watch = 0;
+	int opt_label_interval = LABEL_INTERVAL_DEFAULT_S;
 
 	uint8_t new_label[LABEL_LEN_RAW];
 	memset(new_label, 0x00, sizeof(new_label));
@@ -631,8 +5550,33 @@ int main(int argc, char *argv[]) {
 	printf("LeetCmd v1.0 - Copyright Stefan Poeschel 2015-16\n");
 
 	// option args
+	static const struct option long_options[] = {
+		{"idle", required_argument, NULL, 0x100},
+		{"record", required_argument, NULL, 0x101},
+		{"replay", required_argument, NULL, 0x102},
+		{"realtime", no_argument, NULL, 0x103},
+		{"no-lock", no_argument, NULL, 0x104},
+		{"label-interval", required_argument, NULL, 0x105},
+		{"write-budget", required_argument, NULL, 0x106},
+		{"stats", no_argument, NULL, 0x107},
+		{"predict", required_argument, NULL, 0x108},
+		{"fanotify", required_argument, NULL, 0x109},
+		{"plan", no_argument, NULL, 0x10A},
+		{"dump-trace", no_argument, NULL, 0x10B},
+		{"space-timeout", required_argument, NULL, 0x10C},
+		{"transient", no_argument, NULL, 0x10D},
+		{"revert", no_argument, NULL, 0x10E},
+		{"reverify", no_argument, NULL, 0x10F},
+		{"hysteresis", required_argument, NULL, 0x110},
+		{"fleet", required_argument, NULL, 0x111},
+		{"jobs", required_argument, NULL, 0x112},
+		{"resume", no_argument, NULL, 0x113},
+		{"history", no_argument, NULL, 0x114},
+		{NULL, 0, NULL, 0}
+	};
 	int c;
-	while((c = getopt(argc, argv, "vfkDdIil:L:")) != -1) {
+	char *endp;
+	while((c = getopt_long(argc, argv, "vfkDdIil:L:t:w:", long_options, NULL)) != -1) {
 		switch(c) {
 		case 'v':
 			opt_verbose = 1;
@@ -661,6 +5605,120 @@ int main(int argc, char *argv[]) {
 		case 'L':
 			opt_label_raw = optarg;
 			break;
+		case 't':
+			opt_label_template = optarg;
+			break;
+		case 'w':
+			opt_watch = strtol(optarg, &endp, 10);
+			if(*endp != 0x00 || opt_watch <= 0) {
+				fprintf(stderr, "Invalid watch interval: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 0x100:
+			opt_idle_window = strtol(optarg, &endp, 10);
+			if(*endp == ',')
+				opt_idle_max_defer = strtol(endp + 1, &endp, 10);
+			if(*endp != 0x00 || opt_idle_window <= 0 || opt_idle_max_defer < 0) {
+				fprintf(stderr, "Invalid idle window: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 0x101:
+			opt_record = optarg;
+			break;
+		case 0x102:
+			opt_replay = optarg;
+			break;
+		case 0x103:
+			opt_replay_realtime = 1;
+			break;
+		case 0x104:
+			opt_lock = 0;
+			break;
+		case 0x105:
+			opt_label_interval = strtol(optarg, &endp, 10);
+			if(*endp != 0x00 || opt_label_interval < 0) {
+				fprintf(stderr, "Invalid label interval: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 0x106:
+			opt_budget = strtol(optarg, &endp, 10);
+			if(*endp == '/')
+				opt_budget_period = strtol(endp + 1, &endp, 10);
+			if(*endp != 0x00 || opt_budget <= 0 || opt_budget_period <= 0) {
+				fprintf(stderr, "Invalid write budget: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 0x107:
+			opt_stats = 1;
+			break;
+		case 0x108:
+			opt_predict_min = strtol(optarg, &endp, 10);
+			if(*endp == ',')
+				opt_predict_max = strtol(endp + 1, &endp, 10);
+			if(*endp != 0x00 || opt_predict_min <= 0 || opt_predict_max < opt_predict_min) {
+				fprintf(stderr, "Invalid prediction intervals: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 0x109:
+			opt_fanotify_debounce = strtol(optarg, &endp, 10);
+			if(*endp != 0x00 || opt_fanotify_debounce <= 0) {
+				fprintf(stderr, "Invalid debounce time: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 0x10A:
+			opt_plan = 1;
+			break;
+		case 0x10B:
+			opt_dump_trace = 1;
+			break;
+		case 0x10C:
+			opt_space_timeout = strtol(optarg, &endp, 10);
+			if(*endp != 0x00 || opt_space_timeout <= 0) {
+				fprintf(stderr, "Invalid free space timeout: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 0x10D:
+			opt_transient = 1;
+			break;
+		case 0x10E:
+			opt_revert = 1;
+			break;
+		case 0x10F:
+			opt_reverify = 1;
+			break;
+		case 0x110:
+			{
+				double percent = strtod(optarg, &endp);
+				if(*endp != 0x00 || percent < 0.0 || percent >= 50.0) {
+					fprintf(stderr, "Invalid hysteresis: %s\n", optarg);
+					return 1;
+				}
+				opt_hysteresis_bp = (unsigned int) (percent * 100.0 + 0.5);
+			}
+			break;
+		case 0x111:
+			opt_fleet = optarg;
+			break;
+		case 0x112:
+			opt_jobs = strtol(optarg, &endp, 10);
+			if(*endp != 0x00 || opt_jobs <= 0) {
+				fprintf(stderr, "Invalid number of jobs: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 0x113:
+			opt_resume = 1;
+			break;
+		case 0x114:
+			opt_history = 1;
+			break;
 		case '?':
 		default:
 			usage(argv[0]);
@@ -668,8 +5726,13 @@ int main(int argc, char *argv[]) {
 		}
 	}
 
-	// non-option args
+	// non-option args; with --fleet, drives and paths come from the file
 	switch(argc - optind) {
+	case 0:
+		if(opt_fleet)
+			break;
+		usage(argv[0]);
+		return 1;
 	case 1:
 		opt_device = argv[optind];
 		break;
@@ -682,12 +5745,45 @@ int main(int argc, char *argv[]) {
 		return 1;
 	}
 
+	if((!opt_fleet || opt_watch) && opt_resume) {
+		fprintf(stderr, "--resume only works with --fleet, without -w!\n");
+		return 1;
+	}
+	if(opt_fleet && (opt_device || opt_plan || opt_stats || opt_history || opt_record || opt_replay)) {
+		fprintf(stderr, "No <device>, --plan, --stats, --history, --record or --replay with --fleet!\n");
+		return 1;
+	}
+	if(opt_fleet && opt_watch && opt_fanotify_debounce) {
+		fprintf(stderr, "--fanotify only works with a single <device>!\n");
+		return 1;
+	}
+
 	printf("\n");
 
+	// decode the command trace on demand
+	if(opt_verbose)
+		opt_dump_trace = 1;
+	atexit(dump_trace_at_exit);
+	struct sigaction trace_sa;
+	memset(&trace_sa, 0x00, sizeof(trace_sa));
+	trace_sa.sa_handler = request_trace_dump;
+	trace_sa.sa_flags = SA_RESTART;
+	sigaction(SIGUSR1, &trace_sa, NULL);
+
+
+	if(opt_stats) {
+		open_write_stats(opt_device);
+		print_write_stats(stdout);
+		return 0;
+	}
+
+	if(opt_history)
+		return print_display_history(opt_device);
+
 
 	// check args
 
-	if(opt_label_text && opt_label_raw) {
+	if(!!opt_label_text + !!opt_label_raw + !!opt_label_template > 1) {
 		fprintf(stderr, "Only one label option can be used at the same time!\n");
 		return 1;
 	}
@@ -733,7 +5829,6 @@ int main(int argc, char *argv[]) {
 		size_t i;
 		char word[5];
 		word[4] = 0x00;
-		char *endp;
 		for(i = 0; i < (len / 4); i++) {
 			memcpy(word, opt_label_raw + i * 4, 4);
 
@@ -753,59 +5848,150 @@ int main(int argc, char *argv[]) {
 	}
 
 
+	struct drive drive;
+	memset(&drive, 0x00, sizeof(drive));
+	drive.device = opt_device;
+	drive.path = opt_path && strcmp(opt_path, "-") ? opt_path : NULL;
+	drive.path_arg = drive.path;
+	drive.label_template = opt_label_template;
+	drive.kb_factor = opt_kb_factor ? 1000 : 1024;
+	drive.label_interval = opt_label_interval;
+	drive.fanotify_fd = -1;
+
+	// in watch mode, template and free space are handled by the watch; per drive in fleet mode
+	if(opt_label_template && !opt_watch && !opt_fleet) {
+		char text[LABEL_LEN + 1];
+		encode_label_template(&drive, text, new_label);
+	}
+
+
 	// derive space info
-	struct statvfs space_info;
-	if(opt_path && strcmp(opt_path, "-")) {
-		int statvfs_result = statvfs(opt_path, &space_info);
-		if(statvfs_result) {
-			perror("Error while statvfs");
+	struct request req;
+	init_request(&req);
+	req.disable_vcd = opt_disable_vcd;
+	req.inverse = opt_inverse;
+	if(opt_label_text || opt_label_raw || (opt_label_template && !opt_watch && !opt_fleet)) {
+		req.label_set = 1;
+		memcpy(req.label, new_label, LABEL_LEN_RAW);
+	}
+	if(opt_path && !(opt_watch && drive.path)) {
+		req.free_space = 1;
+		if(strcmp(opt_path, "-"))
+			req.kb_factor = opt_kb_factor ? 1000 : 1024;
+	}
+
+	// nothing to do: show the current state
+	req.disable_vcd_transient = opt_transient;
+	req.inverse_transient = opt_transient;
+	req.revert = opt_revert;
+	if(!opt_watch && opt_disable_vcd == -1 && opt_inverse == -1 && !opt_revert && !req.label_set && !opt_path)
+		req.show_state = 1;
+
+	// probed in the background while the device is opened and checked
+	struct space_probe *space_probe = NULL;
+	uint64_t space_deadline_ms = get_time_ms() + opt_space_timeout;
+	if(req.free_space && drive.path) {
+		space_probe = start_space_probe(opt_path);
+		if(!space_probe)
+			return 1;
+	}
+
+
+	// select transport
+	transport = &sg_transport;
+	if(opt_replay) {
+		if(open_trace(opt_replay, 0))
+			return 1;
+		transport = &replay_transport;
+	}
+	if(opt_record && open_trace(opt_record, 1))
+		return 1;
+
+	// keep own I/O out of the way of data traffic
+	if(opt_idle_window)
+		set_idle_io_priority();
+
+	// all drives of the fleet, each with its own label template and free space
+	if(opt_fleet && opt_watch) {
+		struct fleet_watch watch;
+		memset(&watch, 0x00, sizeof(watch));
+		watch.file = opt_fleet;
+		watch.req = &req;
+		watch.label_template = opt_label_template;
+		watch.kb_factor = opt_kb_factor ? 1000 : 1024;
+		watch.label_interval = opt_label_interval;
+		watch.interval = opt_watch;
+		watch.opt_force = opt_force;
+		watch.opt_reverify = opt_reverify;
+		watch.opt_lock = opt_lock;
+		watch.jobs = opt_jobs;
+		return watch_fleet(&watch);
+	}
+	if(opt_fleet) {
+		struct fleet fleet;
+		memset(&fleet, 0x00, sizeof(fleet));
+		fleet.opt_force = opt_force;
+		fleet.opt_reverify = opt_reverify;
+		fleet.opt_lock = opt_lock;
+		unsigned int kb_factor = opt_kb_factor ? 1000 : 1024;
+		if(load_fleet(&fleet, opt_fleet)
+				|| open_checkpoint(&fleet, opt_fleet, hash_request(&req, opt_label_template, kb_factor), opt_resume))
 			return 1;
+		prepare_fleet(&fleet, &req, opt_label_template, kb_factor);
+		return run_fleet(&fleet, opt_jobs);
+	}
+
+	// serialize with other instances
+	if(opt_lock && !opt_plan && transport == &sg_transport) {
+		int handed_over_result;
+		if(lock_drive(opt_device)) {
+			if(space_probe && finish_space_request(space_probe, space_deadline_ms, opt_path, &req))
+				return 1;
+			space_probe = NULL;
+			if(hand_over_request(&req, &handed_over_result))
+				return handed_over_result;
 		}
 	}
 
+	// refresh accounting + display history + latency history
+	if(transport == &sg_transport && !opt_plan) {
+		open_write_stats(opt_device);
+		open_display_history(opt_device);
+	} else {
+		load_write_stats("");
+	}
+	if(transport == &sg_transport) {
+		open_latency_history(opt_device);
+		atexit(save_latency_histories);
+	}
 
 	// open device
-	device_fd = sg_cmds_open_device(opt_device, 1, opt_verbose);
+	device_fd = transport->open(opt_device, opt_verbose);
+	device_name = opt_device;
 	if(device_fd < 0) {
-		perror("Error while sg_cmds_open_device");
+		perror("Error while opening device");
 		return 1;
 	}
 
 	// check device support
-	if(check_device(opt_device, opt_force))
+	if(transport == &sg_transport ? verify_device(opt_device, opt_force, opt_reverify) : check_device(opt_device, opt_force))
 		return 1;
 	printf("\n");
 
-
-	// handle Disable VCD flag
-	if(handle_mode_page_flag_value(opt_disable_vcd, "Disable VCD", 0x20, 6, 2, 1))
+	if(space_probe && finish_space_request(space_probe, space_deadline_ms, opt_path, &req))
 		return 1;
 
-	// handle Inverse Display flag
-	if(handle_mode_page_flag_value(opt_inverse, "Inverse Display", 0x21, 10, 8, 0))
-		return 1;
+	if(opt_plan)
+		return plan_request(opt_device, &req);
 
-	// handle label
-	if(handle_label_value(opt_label_text || opt_label_raw ? new_label : NULL))
+	if(run_requests(opt_device, &req))
 		return 1;
 
-	// handle free space
-	if(opt_path) {
-		int result;
-		if(strcmp(opt_path, "-")) {
-                        uint64_t bytes_free = space_info.f_bfree;
-                        bytes_free *= space_info.f_frsize;
-
-                        uint64_t bytes_total = space_info.f_blocks;
-                        bytes_total *= space_info.f_frsize;
-
-			result = set_free_space(bytes_free, bytes_total, opt_kb_factor ? 1000.0 : 1024.0);
-		} else {
-			result = set_free_space(0, 0, 0);
-		}
-		if(result)
-			return 1;
+	if(opt_watch) {
+		printf("\n");
+		return watch_drive(&drive, opt_watch);
 	}
 
 	return 0;
 }
+#endif
@@ -0,0 +1,342 @@
+/*
+    LeetCmd - simulated WD My Book devices
+
+	Provides a SCSI transport that emulates the display pages of any number
+	of drives, with per-command latencies drawn from a configurable
+	distribution and optionally injected faults. Used by the benchmark and
+	the soak test.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define LEETCMD_NO_MAIN
+#include "leetcmd.c"
+
+#include <math.h>
+
+
+/*
+ * latency distributions
+ *
+ * fixed:<us>                 every command takes <us>
+ * lognormal:<median>,<sigma> log-normal around <median> us
+ *
+ * Either can be combined with an occasional stall of <us> that hits a
+ * command with the given probability.
+ */
+
+enum sim_latency_type {
+	SIM_LATENCY_FIXED,
+	SIM_LATENCY_LOGNORMAL
+};
+
+struct sim_latency {
+	enum sim_latency_type type;
+	double median_us;
+	double sigma;
+	double stall_probability;
+	double stall_us;
+};
+
+
+/*
+ * fault injection
+ *
+ * open:<p>     opening a device fails
+ * page:<p>     a diagnostic page comes back with a wrong page code
+ * timeout:<p>  a command times out
+ *
+ * Each with probability <p>, comma separated.
+ */
+
+struct sim_faults {
+	double open_failure;
+	double bad_page;
+	double timeout;
+};
+
+
+struct sim_device {
+	char name[32];
+	uint8_t mode_20[6];
+	uint8_t mode_21[10];
+	uint8_t diag_86[16];
+	uint8_t diag_87[8 + LABEL_LEN_RAW];
+};
+
+
+static struct sim_device *sim_devices = NULL;
+static int sim_device_count = 0;
+
+static struct sim_latency sim_latency = {SIM_LATENCY_FIXED, 2000.0, 0.0, 0.0, 0.0};
+static struct sim_faults sim_faults = {0.0, 0.0, 0.0};
+static int sim_sleep = 0;			// really sleep instead of advancing the virtual clock
+static uint64_t sim_virtual_us = 0;
+static uint64_t sim_commands = 0;
+static uint64_t sim_rng = 0x9E3779B97F4A7C15ULL;
+
+
+int compare_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t*) a;
+	uint64_t y = *(const uint64_t*) b;
+	return x < y ? -1 : (x > y);
+}
+
+
+uint64_t percentile(const uint64_t *sorted, size_t n, int p) {
+	size_t index = (n * p + 99) / 100;
+	return sorted[index ? index - 1 : 0];
+}
+
+
+// xorshift64*, deterministic for a given seed
+double sim_random() {
+	sim_rng ^= sim_rng >> 12;
+	sim_rng ^= sim_rng << 25;
+	sim_rng ^= sim_rng >> 27;
+	return ((sim_rng * 0x2545F4914F6CDD1DULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+
+void sim_seed(uint64_t seed) {
+	sim_rng = seed ? seed : 0x9E3779B97F4A7C15ULL;
+}
+
+
+int sim_parse_latency(const char *spec) {
+	char *endp;
+
+	if(!strncmp(spec, "fixed:", 6)) {
+		sim_latency.type = SIM_LATENCY_FIXED;
+		sim_latency.median_us = strtod(spec + 6, &endp);
+	} else if(!strncmp(spec, "lognormal:", 10)) {
+		sim_latency.type = SIM_LATENCY_LOGNORMAL;
+		sim_latency.median_us = strtod(spec + 10, &endp);
+		if(*endp != ',')
+			return 1;
+		sim_latency.sigma = strtod(endp + 1, &endp);
+	} else {
+		return 1;
+	}
+
+	return *endp != 0x00 || sim_latency.median_us < 0.0 || sim_latency.sigma < 0.0;
+}
+
+
+int sim_parse_stall(const char *spec) {
+	char *endp;
+
+	sim_latency.stall_probability = strtod(spec, &endp);
+	if(*endp != ',')
+		return 1;
+	sim_latency.stall_us = strtod(endp + 1, &endp);
+
+	return *endp != 0x00 || sim_latency.stall_probability < 0.0 || sim_latency.stall_probability > 1.0;
+}
+
+
+int sim_parse_faults(const char *spec) {
+	char *endp;
+
+	while(*spec) {
+		double *probability;
+		if(!strncmp(spec, "open:", 5))
+			probability = &sim_faults.open_failure;
+		else if(!strncmp(spec, "page:", 5))
+			probability = &sim_faults.bad_page;
+		else if(!strncmp(spec, "timeout:", 8))
+			probability = &sim_faults.timeout;
+		else
+			return 1;
+
+		*probability = strtod(strchr(spec, ':') + 1, &endp);
+		if((*endp != ',' && *endp != 0x00) || *probability < 0.0 || *probability > 1.0)
+			return 1;
+		spec = *endp ? endp + 1 : endp;
+	}
+
+	return 0;
+}
+
+
+// only draws if the fault is enabled, so runs without faults stay reproducible
+int sim_fault(double probability) {
+	return probability > 0.0 && sim_random() < probability;
+}
+
+
+uint64_t sim_draw_latency() {
+	double us = sim_latency.median_us;
+
+	if(sim_latency.type == SIM_LATENCY_LOGNORMAL) {
+		// Box-Muller
+		double u1 = sim_random();
+		double u2 = sim_random();
+		double z = sqrt(-2.0 * log(u1 > 0.0 ? u1 : 1e-300)) * cos(2.0 * M_PI * u2);
+		us *= exp(sim_latency.sigma * z);
+	}
+
+	if(sim_latency.stall_probability > 0.0 && sim_random() < sim_latency.stall_probability)
+		us += sim_latency.stall_us;
+
+	return (uint64_t) us;
+}
+
+
+void sim_set_sense(struct scsi_cmd *cmd, uint8_t sense_key, uint8_t asc, uint8_t ascq) {
+	// fixed format sense data
+	memset(cmd->sense, 0x00, 18);
+	cmd->sense[0] = 0x70;
+	cmd->sense[2] = sense_key;
+	cmd->sense[7] = 10;
+	cmd->sense[12] = asc;
+	cmd->sense[13] = ascq;
+	cmd->sense_len = 18;
+}
+
+
+int sim_open(const char *device, int verbose) {
+	(void) verbose;
+
+	if(sim_fault(sim_faults.open_failure)) {
+		errno = ENODEV;
+		return -1;
+	}
+
+	// a reopened device keeps its pages
+	int i;
+	for(i = 0; i < sim_device_count; i++)
+		if(!strcmp(sim_devices[i].name, device))
+			return i;
+
+	struct sim_device *devices = realloc(sim_devices, (sim_device_count + 1) * sizeof(*devices));
+	if(!devices)
+		return -1;
+	sim_devices = devices;
+
+	struct sim_device *dev = &sim_devices[sim_device_count];
+	memset(dev, 0x00, sizeof(*dev));
+	snprintf(dev->name, sizeof(dev->name), "%s", device);
+	dev->diag_86[0] = 0x33;
+	dev->diag_86[1] = 0x0A;
+	dev->diag_86[2] = 0x03;
+
+	return sim_device_count++;
+}
+
+
+int sim_close(int fd) {
+	(void) fd;
+	return 0;
+}
+
+
+int sim_execute(int fd, struct scsi_cmd *cmd) {
+	struct sim_device *dev = &sim_devices[fd];
+	uint8_t page = cmd->cdb[2];
+	uint8_t *content = NULL;
+	size_t content_len = 0;
+
+	sim_commands++;
+	uint64_t latency = sim_draw_latency();
+	if(sim_sleep)
+		sleep_us(latency);
+	else
+		sim_virtual_us += latency;
+
+	// no response within the SG timeout
+	if(sim_fault(sim_faults.timeout)) {
+		if(!sim_sleep)
+			sim_virtual_us += SCSI_TIMEOUT_SECS * 1000000ULL;
+		return SG_LIB_CAT_TIMEOUT;
+	}
+
+	switch(cmd->cdb[0]) {
+	case 0x12:	// INQUIRY
+		if(cmd->data_len < INQUIRY_LEN)
+			break;
+		memset(cmd->data_in, 0x20, INQUIRY_LEN);
+		cmd->data_in[0] = 0x0D;
+		memcpy(cmd->data_in + 8, SUPPORTED_MODELS[0], 8);
+		memcpy(cmd->data_in + 16, SUPPORTED_MODELS[1], 16);
+		memcpy(cmd->data_in + 32, "1030", 4);
+		cmd->data_in_len = INQUIRY_LEN;
+		return 0;
+
+	case 0x1A:	// MODE SENSE(6)
+	case 0x15:	// MODE SELECT(6)
+		if(cmd->cdb[0] == 0x15)
+			page = cmd->data_len > 4 ? cmd->data_out[4] & 0x3F : 0;
+		else
+			page &= 0x3F;
+		if(page == 0x20) {
+			content = dev->mode_20;
+			content_len = sizeof(dev->mode_20);
+		} else if(page == 0x21) {
+			content = dev->mode_21;
+			content_len = sizeof(dev->mode_21);
+		}
+		if(!content || cmd->data_len != 6 + content_len)
+			break;
+
+		if(cmd->cdb[0] == 0x15) {
+			memcpy(content, cmd->data_out + 6, content_len);
+		} else {
+			memset(cmd->data_in, 0x00, 6);
+			cmd->data_in[0] = content_len + 5;
+			cmd->data_in[4] = 0x80 | page;
+			cmd->data_in[5] = content_len;
+			memcpy(cmd->data_in + 6, content, content_len);
+			cmd->data_in_len = cmd->data_len;
+		}
+		return 0;
+
+	case 0x1C:	// RECEIVE DIAGNOSTIC RESULTS
+	case 0x1D:	// SEND DIAGNOSTIC
+		if(cmd->cdb[0] == 0x1D)
+			page = cmd->data_len > 0 ? cmd->data_out[0] : 0;
+		if(page == 0x86) {
+			content = dev->diag_86;
+			content_len = sizeof(dev->diag_86);
+		} else if(page == 0x87) {
+			content = dev->diag_87;
+			content_len = sizeof(dev->diag_87);
+		}
+		if(!content || cmd->data_len != 4 + content_len)
+			break;
+
+		if(cmd->cdb[0] == 0x1D) {
+			memcpy(content, cmd->data_out + 4, content_len);
+		} else {
+			cmd->data_in[0] = sim_fault(sim_faults.bad_page) ? page ^ 0x01 : page;
+			cmd->data_in[1] = 0x00;
+			cmd->data_in[2] = content_len >> 8;
+			cmd->data_in[3] = content_len & 0xFF;
+			memcpy(cmd->data_in + 4, content, content_len);
+			cmd->data_in_len = cmd->data_len;
+		}
+		return 0;
+	}
+
+	// ILLEGAL REQUEST - INVALID FIELD IN CDB
+	sim_set_sense(cmd, 0x05, 0x24, 0x00);
+	return SG_LIB_CAT_ILLEGAL_REQ;
+}
+
+
+static const struct transport sim_transport = {
+	sim_open,
+	sim_close,
+	sim_execute
+};
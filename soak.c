@@ -0,0 +1,325 @@
+/*
+    LeetCmd - soak test
+
+	Runs the update cycle of the watch mode (label template and free space)
+	round-robin over many simulated drives for millions of cycles, with
+	injected faults. A drive whose cycle failed is closed and reopened, as
+	it would be by a daemon. Resident memory, open file descriptors, heap
+	in use and cycle latency are sampled once per window and printed as
+	one JSON object each. The run fails if any of them ends up higher than
+	at the start by more than the allowed growth.
+
+	Latencies are the tool's own CPU time per cycle; simulated device time
+	only advances the virtual clock. The tool's schedules (breaker cool-down,
+	free space sampling) run on a virtual clock as well, one watch interval
+	ahead per round over all drives. Label and free space change every
+	cycle of a drive and the label interval is off, so every cycle writes
+	both pages.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sim.c"
+
+#include <malloc.h>
+
+#define SOAK_DEVICES_DEFAULT 64
+#define SOAK_CYCLES_DEFAULT 2000000
+#define SOAK_FAULTS_DEFAULT "open:0.001,page:0.001,timeout:0.001"
+#define SOAK_GROWTH_DEFAULT_PERCENT 10
+#define SOAK_LATENCY_GROWTH_DEFAULT_PERCENT 50
+#define SOAK_WINDOWS 20
+#define SOAK_CHANGE_CYCLES 1		// label and unit flip every that many cycles of a drive
+#define SOAK_INTERVAL_S 1			// watch interval, the virtual clock advances by it every round
+
+
+struct soak_drive {
+	char name[32];
+	int fd;						// -1: closed
+	struct drive drive;
+};
+
+struct soak_sample {
+	uint64_t rss_kb;
+	uint64_t fds;
+	uint64_t heap_bytes;
+	uint64_t p50_us;
+	uint64_t p99_us;
+};
+
+
+static uint64_t soak_reopens = 0;
+static uint64_t soak_failed_cycles = 0;
+
+
+uint64_t get_rss_kb() {
+	unsigned long long size;
+	unsigned long long resident = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+	if(f) {
+		if(fscanf(f, "%llu %llu", &size, &resident) != 2)
+			resident = 0;
+		fclose(f);
+	}
+	return resident * sysconf(_SC_PAGESIZE) / 1024;
+}
+
+
+uint64_t count_fds() {
+	uint64_t count = 0;
+	DIR *dir = opendir("/proc/self/fd");
+	if(!dir)
+		return 0;
+
+	struct dirent *entry;
+	while((entry = readdir(dir)))
+		count += entry->d_name[0] != '.';
+	closedir(dir);
+
+	// without the one of the listing itself
+	return count - 1;
+}
+
+
+uint64_t get_heap_bytes() {
+	struct mallinfo2 info = mallinfo2();
+	return info.uordblks + info.hblkhd;
+}
+
+
+int open_soak_drive(struct soak_drive *sd) {
+	sd->fd = transport->open(sd->name, 0);
+	if(sd->fd < 0)
+		return 1;
+	device_fd = sd->fd;
+	device_name = sd->name;
+
+	// as at the start of the watch mode
+	sd->drive.space_written_valid = 0;
+	if(check_device(sd->name, 0) || read_label_page(sd->drive.label_page) || read_space_page(sd->drive.space_page)) {
+		transport->close(sd->fd);
+		sd->fd = -1;
+		return 1;
+	}
+	return 0;
+}
+
+
+void soak_cycle(struct soak_drive *sd, uint64_t cycle) {
+	struct drive *drive = &sd->drive;
+	if(!breaker_allows(&drive->breaker, get_time_ms()))
+		return;
+
+	uint64_t failures = command_failures;
+	int failed = 0;
+	if(sd->fd < 0) {
+		soak_reopens++;
+		failed = open_soak_drive(sd);
+	}
+	if(!failed) {
+		device_fd = sd->fd;
+		device_name = sd->name;
+
+		// keep pages changing, so they keep being written
+		int flip = (cycle / SOAK_CHANGE_CYCLES) % 2;
+		drive->label_template = flip ? "SOAK {host}" : "SOAK";
+		drive->kb_factor = flip ? 1000 : 1024;
+		failed = update_label(drive) | update_space(drive, SOAK_INTERVAL_S);
+	}
+	failed |= command_failures != failures;
+	breaker_record(&drive->breaker, sd->name, failed, get_time_ms());
+
+	// reconnect next cycle
+	if(failed) {
+		soak_failed_cycles++;
+		if(sd->fd >= 0) {
+			transport->close(sd->fd);
+			sd->fd = -1;
+		}
+	}
+	device_fd = -1;
+}
+
+
+// median of a run of samples of one metric
+uint64_t median_sample(const struct soak_sample *samples, size_t first, size_t count, size_t offset) {
+	uint64_t values[SOAK_WINDOWS];
+	size_t i;
+	for(i = 0; i < count; i++)
+		values[i] = *(const uint64_t*) ((const uint8_t*) &samples[first + i] + offset);
+	qsort(values, count, sizeof(*values), compare_u64);
+	return values[count / 2];
+}
+
+
+// 1: grown beyond the threshold from the first to the last third of the run
+int check_growth(FILE *err, const struct soak_sample *samples, size_t offset, const char *name, int percent, uint64_t slack) {
+	// the first window warms up caches and thread stacks
+	size_t third = (SOAK_WINDOWS - 1) / 3;
+	uint64_t start = median_sample(samples, 1, third, offset);
+	uint64_t end = median_sample(samples, SOAK_WINDOWS - third, third, offset);
+	uint64_t limit = start + start * percent / 100 + slack;
+
+	if(end <= limit)
+		return 0;
+	fprintf(err, "%s grew from %llu to %llu (limit %llu)\n", name,
+			(unsigned long long) start, (unsigned long long) end, (unsigned long long) limit);
+	return 1;
+}
+
+
+void soak_usage(const char* exe) {
+	printf("Usage: %s [OPTIONS]\n", exe);
+	printf("\n");
+	printf("  -n <count>    simulated drives (default %d)\n", SOAK_DEVICES_DEFAULT);
+	printf("  -c <count>    update cycles over all drives (default %d)\n", SOAK_CYCLES_DEFAULT);
+	printf("  -p <path>     file system whose free space to display (default /)\n");
+	printf("  -l <dist>     command latency: fixed:<us> or lognormal:<median us>,<sigma>\n");
+	printf("  -e <faults>   open:<p>,page:<p>,timeout:<p> (default %s)\n", SOAK_FAULTS_DEFAULT);
+	printf("  -g <percent>  allowed growth of memory (default %d)\n", SOAK_GROWTH_DEFAULT_PERCENT);
+	printf("  -G <percent>  allowed growth of cycle latency (default %d)\n", SOAK_LATENCY_GROWTH_DEFAULT_PERCENT);
+	printf("  -r <seed>     random seed\n");
+}
+
+
+int main(int argc, char *argv[]) {
+	int devices = SOAK_DEVICES_DEFAULT;
+	uint64_t cycles = SOAK_CYCLES_DEFAULT;
+	const char *path = "/";
+	const char *faults = SOAK_FAULTS_DEFAULT;
+	int growth = SOAK_GROWTH_DEFAULT_PERCENT;
+	int latency_growth = SOAK_LATENCY_GROWTH_DEFAULT_PERCENT;
+	uint64_t seed = 1;
+
+	int c;
+	while((c = getopt(argc, argv, "n:c:p:l:e:g:G:r:")) != -1) {
+		switch(c) {
+		case 'n':
+			devices = atoi(optarg);
+			break;
+		case 'c':
+			cycles = strtoull(optarg, NULL, 0);
+			break;
+		case 'p':
+			path = optarg;
+			break;
+		case 'l':
+			if(sim_parse_latency(optarg)) {
+				fprintf(stderr, "Invalid latency distribution: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'e':
+			faults = optarg;
+			break;
+		case 'g':
+			growth = atoi(optarg);
+			break;
+		case 'G':
+			latency_growth = atoi(optarg);
+			break;
+		case 'r':
+			seed = strtoull(optarg, NULL, 0);
+			break;
+		default:
+			soak_usage(argv[0]);
+			return 1;
+		}
+	}
+	if(devices < 1 || cycles < SOAK_WINDOWS || growth < 0 || latency_growth < 0 || optind != argc) {
+		soak_usage(argv[0]);
+		return 1;
+	}
+	if(sim_parse_faults(faults)) {
+		fprintf(stderr, "Invalid faults: %s\n", faults);
+		return 1;
+	}
+
+	// results go to the original stdout and stderr, the tool's own output is discarded
+	FILE *out = fdopen(dup(STDOUT_FILENO), "w");
+	FILE *err = fdopen(dup(STDERR_FILENO), "w");
+	if(!out || !err || !freopen("/dev/null", "w", stdout) || !freopen("/dev/null", "w", stderr)) {
+		perror("Error while redirecting output");
+		return 1;
+	}
+
+	transport = &sim_transport;
+	sim_seed(seed);
+	load_write_stats("");
+
+	uint64_t window_cycles = cycles / SOAK_WINDOWS;
+	struct soak_drive *drives = calloc(devices, sizeof(*drives));
+	uint64_t *latencies = malloc(window_cycles * sizeof(*latencies));
+	if(!drives || !latencies) {
+		fprintf(err, "Error while malloc\n");
+		return 1;
+	}
+	int i;
+	for(i = 0; i < devices; i++) {
+		struct soak_drive *sd = &drives[i];
+		snprintf(sd->name, sizeof(sd->name), "sim%d", i);
+		sd->fd = -1;
+		sd->drive.device = sd->name;
+		sd->drive.path = path;
+		sd->drive.path_arg = path;
+		sd->drive.fanotify_fd = -1;
+		sd->drive.label_interval = 0;
+	}
+
+	struct soak_sample samples[SOAK_WINDOWS];
+	uint64_t cycle = 0;
+	int window;
+	for(window = 0; window < SOAK_WINDOWS; window++) {
+		uint64_t j;
+		for(j = 0; j < window_cycles; j++, cycle++) {
+			if(cycle % devices == 0)
+				clock_skew_ms += SOAK_INTERVAL_S * 1000;
+			uint64_t start = get_time_us();
+			soak_cycle(&drives[cycle % devices], cycle / devices);
+			latencies[j] = get_time_us() - start;
+		}
+		qsort(latencies, window_cycles, sizeof(*latencies), compare_u64);
+
+		struct soak_sample *sample = &samples[window];
+		sample->rss_kb = get_rss_kb();
+		sample->fds = count_fds();
+		sample->heap_bytes = get_heap_bytes();
+		sample->p50_us = percentile(latencies, window_cycles, 50);
+		sample->p99_us = percentile(latencies, window_cycles, 99);
+
+		fprintf(out, "{\"cycles\": %llu, \"rss_kb\": %llu, \"fds\": %llu, \"heap_bytes\": %llu, "
+				"\"p50_cycle_us\": %llu, \"p99_cycle_us\": %llu, \"failed_cycles\": %llu, \"reopens\": %llu, \"commands\": %llu}\n",
+				(unsigned long long) cycle,
+				(unsigned long long) sample->rss_kb,
+				(unsigned long long) sample->fds,
+				(unsigned long long) sample->heap_bytes,
+				(unsigned long long) sample->p50_us,
+				(unsigned long long) sample->p99_us,
+				(unsigned long long) soak_failed_cycles,
+				(unsigned long long) soak_reopens,
+				(unsigned long long) sim_commands);
+		fflush(out);
+	}
+
+	// fds must not grow at all; a few us of latency is noise
+	int result = check_growth(err, samples, offsetof(struct soak_sample, rss_kb), "RSS (kB)", growth, 0)
+			| check_growth(err, samples, offsetof(struct soak_sample, fds), "Open fds", 0, 0)
+			| check_growth(err, samples, offsetof(struct soak_sample, heap_bytes), "Heap in use (bytes)", growth, 0)
+			| check_growth(err, samples, offsetof(struct soak_sample, p50_us), "p50 cycle latency (us)", latency_growth, 2)
+			| check_growth(err, samples, offsetof(struct soak_sample, p99_us), "p99 cycle latency (us)", latency_growth, 2);
+
+	fprintf(out, "{\"result\": \"%s\"}\n", result ? "fail" : "pass");
+	fflush(err);
+	return result;
+}